@@ -26,16 +26,51 @@
 #ifndef _DISPLAY_H_
 #define _DISPLAY_H_
 
+/** Display feature flag: vertical scrolling via display start line */
+#define DISPLAY_FEATURE_START_LINE  0x01
+
 /** General struct to hold all information relevant to different displays */
 typedef struct {
     /** Function pointer to initialize the display itself */
     void (*init)(void);
-    /** Function pointer called whenever a new frame is received via USB */
-    void (*frame_start)(void);
+    /**
+     * Function pointer called whenever a new frame, or a part of it, is
+     * received via USB. Sets the display up to receive data starting at the
+     * given column and page. Data beyond the given last column continues on
+     * the next page, at least for displays supporting column ranges. For all
+     * others, the next page is started with another frame_start() call anyway.
+     */
+    void (*frame_start)(uint8_t column, uint8_t column_end, uint8_t page);
     /** Function pointer called for each single byte to send to the display */
     void (*send_byte)(uint8_t);
     /** Function pointed called after a frame was received */
     void (*frame_done)(void);
+    /**
+     * Function pointer to send a single command byte to the display
+     * controller, e.g. to change its contrast. Must not be called between
+     * frame_start() and frame_done().
+     */
+    void (*command)(uint8_t);
+    /**
+     * Set if data beyond the frame_start() last column continues at its
+     * first column on the next page by itself, i.e. no new frame_start()
+     * call is needed for each page of a window narrower than the display.
+     */
+    uint8_t column_wrap;
+    /**
+     * Function pointer to set the display RAM row shown in the top row of
+     * the display, wrapping around at the display's last row, or NULL if
+     * the display has no such thing. Setting it advertises the display
+     * feature DISPLAY_FEATURE_START_LINE.
+     */
+    void (*set_start_line)(uint8_t line);
+    /**
+     * Shadow copy of the display RAM, res_x * res_y / 8 bytes in the same
+     * page-major layout. The display's init function fills it along with
+     * the splash screen, and all data written to the display afterwards is
+     * copied to it, so display content can be read back, e.g. to invert it.
+     */
+    uint8_t *framebuffer;
     /** Display information */
     struct {
         /* Display's X resolution i.e. display width in pixels */
@@ -46,6 +81,8 @@ typedef struct {
         uint8_t color_bits;
         /* Identifier string to give a nice name to this display */
         char identifier[20];
+        /* Supported features, DISPLAY_FEATURE_* flags */
+        uint8_t features;
     } properties;
 } display_t;
 
@@ -26,10 +26,12 @@
 #include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 #include "usbconfig.h"
 #include "usbdrv/usbdrv.h"
 #include "display.h"
+#include "font.h"
 
 /** The device code's version */
 #define VERSION "1.0"
@@ -57,30 +59,1376 @@ uint8_t banner[] = "RUDY usbxbm " VERSION;
 /**
  * Host sends a new image frame. This request includes a data transfer to
  * send the actual raw image data that is forwarded to the display then.
+ *
+ * The data starts at the column and page given in wValue's lower and upper
+ * byte, so a frame can also be sent in parts, e.g. page by page.
+ */
+#define CMD_DATA    0x20
+/**
+ * Host sends a part of an image frame. Just like CMD_DATA, but the data
+ * only covers a rectangular window of the display, given as column and page
+ * range: wValue holds the first column in its low byte and the last column
+ * in its high byte, wIndex holds the first and last page the same way.
+ * The data fills the window page by page, each from first to last column.
+ */
+#define CMD_WINDOW  0x21
+/**
+ * Host sends a run-length encoded part of an image frame. Same window
+ * parameters as CMD_WINDOW, but the data is PackBits encoded: a header byte
+ * n of 0-127 is followed by n+1 literal bytes, a header byte n of 129-255 is
+ * followed by a single byte that is repeated 257-n times, and a header byte
+ * of 128 is ignored. The request's wLength is the encoded data's length.
+ */
+#define CMD_DATA_RLE 0x22
+/**
+ * Host sends a tile encoded part of an image frame. Same window parameters
+ * as CMD_WINDOW, but each page of the window is split into tiles of up to
+ * 8 columns, i.e. 8 bytes, starting at the window's first column. The data
+ * is a sequence of tokens, each either
+ *  - 0xf0-0xff: a literal tile, followed by the tile's bytes, which are
+ *    written to the display and stored in the tile dictionary entry given
+ *    in the lower nibble, or
+ *  - 0x00-0xef: a dictionary entry given in the lower nibble, written as
+ *    tile as many times as the upper nibble plus one.
+ * The tile dictionary is kept across requests, so tiles can be reused from
+ * earlier frames. The host is in full control of which entry is used when.
+ */
+#define CMD_DATA_TILE 0x23
+/**
+ * Host sends a subset of the display's pages, e.g. every other page for
+ * interlaced updates. wValue holds the page mask, with bit n set for every
+ * page n that is sent, and wIndex holds the request that defines how the
+ * data is encoded: CMD_WINDOW for raw data, CMD_DATA_RLE, or CMD_DATA_TILE.
+ * The data covers the full width of each page, sent from the lowest to the
+ * highest page in the mask.
+ */
+#define CMD_PAGES   0x24
+/**
+ * Host sends a list of single pixels to change, 2 bytes each: the pixel's
+ * column, and its row in the lower 6 bits, combined with 0x80 to set the
+ * pixel, 0x40 to invert it, or neither to unset it. Only the display bytes
+ * containing those pixels are sent to the display, so pixels should be
+ * ordered by page and column, to change each display byte just once, and
+ * to let the display continue at the next column without readdressing it.
+ */
+#define CMD_PIXELS  0x25
+/**
+ * Host writes 2 bytes, given as wIndex, to the display at the column and
+ * page given in wValue's lower and upper byte, without any data transfer.
+ * A second byte beyond the display's last column is ignored.
+ */
+#define CMD_POKE    0x26
+/**
+ * Host writes 4 more bytes, given as wValue and wIndex, right after the
+ * previous CMD_POKE or CMD_POKE_NEXT bytes on the same page, again without
+ * any data transfer. Bytes beyond the display's last column are ignored.
+ */
+#define CMD_POKE_NEXT 0x27
+/**
+ * Host sends a stream of sub-commands, each one a BATCH_* byte followed by
+ * its parameters, so a whole frame's worth of requests can be done in one
+ * single transfer.
+ */
+#define CMD_BATCH   0x28
+/**
+ * Host sets the display start line, i.e. the display RAM row shown in the
+ * display's top row, given as wValue. Only supported by displays with the
+ * DISPLAY_FEATURE_START_LINE feature.
+ *
+ * All other requests address display RAM, so with a start line other than
+ * 0, their columns and pages, or rows, are shifted up by the start line on
+ * the display, wrapping around at the bottom. Every new connection starts
+ * with a start line of 0 again.
+ */
+#define CMD_SCROLL  0x30
+/**
+ * Host sends a text to render on the device with its built-in font.
+ * wValue holds the column in its low byte and the page in its high byte
+ * where the text starts, wIndex set to 1 renders it inverted. The data is
+ * the ASCII text itself, each character taking up FONT_WIDTH + 1 columns.
+ * Anything beyond the display's last column is cut off, and characters
+ * missing in the font are shown as '?'.
+ */
+#define CMD_TEXT    0x31
+/**
+ * Host requests to fill a rectangular area of the display with a byte
+ * pattern. wValue holds the first column in its low byte and the last
+ * column in its high byte, wIndex holds the first page in the lower and
+ * the last page in the upper nibble of its low byte, and the pattern in
+ * its high byte, e.g. 0xff for all pixels set. There's no data transfer.
+ */
+#define CMD_FILL    0x32
+/**
+ * Host requests to invert a rectangular area of the display. Same window
+ * parameters as CMD_FILL, without the pattern.
+ */
+#define CMD_INVERT  0x33
+/** Host requests to clear the whole display, i.e. unset all pixels */
+#define CMD_CLEAR   0x34
+/**
+ * Host uploads data to the device's asset pool, starting at the offset
+ * given as wValue. A running animation is stopped, since its frames may
+ * get overwritten.
+ */
+#define CMD_ASSET   0x40
+/**
+ * Host starts an animation stored in the asset pool at the offset given as
+ * wValue, showing its next frame every wIndex milliseconds, or stops it
+ * with a wIndex of 0. Once started, it keeps running without any further
+ * USB traffic, even after the host disconnected.
+ *
+ * The animation is stored as a 4 byte header of first and last column,
+ * first and last page in the lower and upper nibble, and frame count,
+ * followed by each frame's length as 16 bit little-endian value and its
+ * data, PackBits encoded just like for CMD_DATA_RLE.
+ */
+#define CMD_ANIMATE 0x41
+/**
+ * Host defines sprite number wIndex to be the image stored in the asset
+ * pool at the offset given as wValue, hiding it if it was visible.
+ *
+ * A sprite image is stored as its width and height in pixels, followed by
+ * its data in the display's memory layout, i.e. one byte per column for
+ * each page of 8 rows, with all rows beyond its height unset.
+ */
+#define CMD_SPRITE_SET  0x42
+/**
+ * Host moves sprite number wIndex to the column and row given in wValue's
+ * lower and upper byte, i.e. its top left corner, and shows it there.
+ *
+ * Shown sprites stay on top of the display content, all other requests only
+ * change what's beneath them.
+ */
+#define CMD_SPRITE_MOVE 0x43
+/** Host hides sprite number wIndex */
+#define CMD_SPRITE_HIDE 0x44
+/** Reset the display to its initial state */
+#define CMD_RESET   0xf0
+/** BYE Request, host gracefully disconnects */
+#define CMD_BYE     0xaa
+
+/**
+ * CMD_BATCH sub-command to set up a new window, followed by its first and
+ * last column, and its first and last page in the lower and upper nibble.
+ */
+#define BATCH_WINDOW    0x01
+/**
+ * CMD_BATCH sub-commands to write data to the current window, followed by
+ * the data's length as 16 bit little-endian value and the data itself,
+ * either as-is, or encoded like for CMD_DATA_RLE or CMD_DATA_TILE.
+ */
+#define BATCH_DATA      0x02
+#define BATCH_DATA_RLE  0x03
+#define BATCH_DATA_TILE 0x04
+/**
+ * CMD_BATCH sub-command to fill the whole current window, followed by the
+ * byte to fill it with. This ends the window.
+ */
+#define BATCH_FILL      0x05
+/**
+ * CMD_BATCH sub-command to send command bytes to the display controller,
+ * followed by the number of command bytes and the bytes themselves. This
+ * ends the current window.
+ */
+#define BATCH_COMMAND   0x06
+/**
+ * CMD_BATCH sub-command to set the display start line like CMD_SCROLL,
+ * followed by the start line. This ends the current window.
+ */
+#define BATCH_SCROLL    0x07
+
+/** Idle state, device is waiting for new connections */
+#define ST_IDLE     0
+/** Ready state, device has a connection and is ready to receive image data */
+#define ST_READY    1
+/** The current state the device is in, ST_IDLE or ST_READY */
+uint8_t state = ST_IDLE;
+
+/** CMD_HELLO expected wValue parameter */
+#define HELLO_VALUE 0x4d6f
+/** CMD_HELLO expected wIndex parameter */
+#define HELLO_INDEX 0x6921
+/* ..adding up to ASCII of the Finnish greeting 'Moi!' */
+
+/** Number of bytes to expect from the CMD_DATA request */
+static uint16_t recv_len;
+/** Bytes received during the CMD_DATA request's data transfer */
+static uint16_t recv_cnt;
+
+/** First column of the window received data is written to */
+static uint8_t window_column_start;
+/** Last column of the window received data is written to */
+static uint8_t window_column_end;
+/** First page of the window received data is written to */
+static uint8_t window_page_start;
+/** Last page of the window received data is written to */
+static uint8_t window_page_end;
+/** Mask of the pages within the window that data is written to */
+static uint8_t window_pages;
+/** Set if the window covers the display's full width */
+static uint8_t window_full_width;
+/** Set to restart the display's frame at the next page regardless */
+static uint8_t window_restart;
+/** Column the next received byte is written to */
+static uint8_t window_column;
+/** Page the next received byte is written to */
+static uint8_t window_page;
+
+/** Set if a CMD_FILL, CMD_INVERT, or CMD_CLEAR request waits for the main loop */
+static uint8_t fill_pending;
+/** First column of the pending fill's window */
+static uint8_t fill_column_start;
+/** Last column of the pending fill's window */
+static uint8_t fill_column_end;
+/** First page of the pending fill's window */
+static uint8_t fill_page_start;
+/** Last page of the pending fill's window */
+static uint8_t fill_page_end;
+/** Byte pattern the pending fill writes */
+static uint8_t fill_pattern;
+/** Set if the pending fill inverts the window instead */
+static uint8_t fill_invert;
+
+/** Request the current data transfer belongs to, decides how to decode it */
+static uint8_t recv_request;
+
+/** Bytes left in the current run-length encoded packet, 0 if a header is next */
+static uint8_t rle_count;
+/** Set if the current run-length encoded packet is a repeated byte */
+static uint8_t rle_repeat;
+/** Byte the current run-length encoded repeat writes */
+static uint8_t rle_byte;
+/** Bytes left to write of the current run-length encoded repeat, see expand() */
+static uint8_t rle_left;
+
+/**
+ * Most bytes a repeat in run-length or tile encoded data is expanded to in
+ * one go while receiving it. A single header or token can stand for up to
+ * 128 display bytes, and a single 8 byte chunk of them for a whole display
+ * frame, which takes some 25 ms to send over I2C. Rather than doing that
+ * within one usbFunctionWrite() call, the expansion is split up, and the
+ * main loop continues it in between polling V-USB, with further data held
+ * off until it's done. 32 bytes take under 1 ms over I2C at 400 kHz.
+ *
+ * The transfer's last chunk is the exception, see usbFunctionWrite().
+ */
+#define EXPAND_MAX  32
+/** Bytes of the last received chunk, kept until they're all processed */
+static uint8_t recv_chunk[8];
+/** Number of bytes in recv_chunk */
+static uint8_t recv_chunk_len;
+/** Position of the next byte to process in recv_chunk */
+static uint8_t recv_chunk_pos;
+/** Set if processing the last received chunk continues in the main loop */
+static uint8_t recv_pending;
+
+/**
+ * Number of tile dictionary entries. Each one takes 8 bytes of SRAM, and
+ * with 16 entries, a token fits the entry number and repeat count in one
+ * byte. More entries would rarely pay off on an 84 or 128 columns display,
+ * but eat into the 2 KiB SRAM the ATmega328 has to share with V-USB and
+ * the stack.
+ */
+#define TILE_ENTRIES 16
+/** Tile dictionary for CMD_DATA_TILE requests */
+static uint8_t tiles[TILE_ENTRIES][8];
+/** Columns left until the end of the display for CMD_TEXT requests */
+static uint8_t text_columns;
+/** Value each CMD_TEXT column is XORed with, 0xff to invert the text */
+static uint8_t text_invert;
+
+/** Bytes left of the current literal tile, 0 if a token is next */
+static uint8_t tile_count;
+/** Dictionary entry the current literal tile is stored in, or repeated from */
+static uint8_t tile_entry;
+/** Next byte position within the current literal tile */
+static uint8_t tile_pos;
+/** Tiles left to write of the current dictionary token, see expand() */
+static uint8_t tile_left;
+
+/**
+ * Size of the asset pool in bytes. Next to the display's framebuffer of up
+ * to 1 KiB, the tile dictionary, V-USB, and everything else, this leaves
+ * the SSD1306 build with some 400 bytes for the stack, which gets deepest
+ * while drawing sprites or decoding batches from within V-USB's callbacks.
+ * See the firmware section of the README for the numbers.
+ */
+#define ASSET_SIZE  256
+/** Asset pool for data uploaded with CMD_ASSET */
+static uint8_t assets[ASSET_SIZE];
+/** Asset pool offset the next received CMD_ASSET byte is stored at */
+static uint16_t asset_pos;
+
+/** Asset pool offset of the running animation's header */
+static uint16_t anim_offset;
+/** Asset pool offset of the running animation's next frame */
+static uint16_t anim_pos;
+/** Frames left until the running animation starts over */
+static uint8_t anim_frames;
+/** Milliseconds between two animation frames, 0 if no animation is running */
+static uint16_t anim_interval;
+/** Milliseconds passed since the last animation frame */
+static uint16_t anim_elapsed;
+
+/** Marks that there is no pending pixel byte, or no open pixel frame */
+#define PIXEL_NONE  0xffff
+/** Column of the CMD_PIXELS pixel that is currently received */
+static uint8_t pixel_column;
+/** Framebuffer index of the changed byte not yet sent, or PIXEL_NONE */
+static uint16_t pixel_index;
+/** Framebuffer index the display continues at, or PIXEL_NONE if unknown */
+static uint16_t pixel_next;
+/** Set if a CMD_PIXELS frame is started and not yet ended */
+static uint8_t pixel_frame;
+
+/** Column the next CMD_POKE_NEXT byte is written to */
+static uint8_t poke_column;
+/** Page CMD_POKE_NEXT bytes are written to, 0xff if there was no CMD_POKE */
+static uint8_t poke_page = 0xff;
+
+/** Current CMD_BATCH sub-command, 0 if a sub-command byte is next */
+static uint8_t batch_op;
+/** Parameter bytes of the current CMD_BATCH sub-command received so far */
+static uint8_t batch_argc;
+/** Parameters of the current CMD_BATCH sub-command */
+static uint8_t batch_args[3];
+/** Data or command bytes left of the current CMD_BATCH sub-command */
+static uint16_t batch_len;
+/** Set if a CMD_BATCH window is set up and its frame started */
+static uint8_t batch_window;
+/** Set if the CMD_BATCH stream was invalid, ignoring everything after it */
+static uint8_t batch_error;
+
+/** Number of sprites that can be defined at once */
+#define SPRITE_COUNT 8
+
+/** Sprite definition and state */
+typedef struct {
+    /** Asset pool offset of the sprite's image */
+    uint16_t offset;
+    /** Column of the sprite's top left corner */
+    uint8_t x;
+    /** Row of the sprite's top left corner */
+    uint8_t y;
+    /** Set if the sprite is currently shown */
+    uint8_t visible;
+} sprite_t;
+
+/** Sprite table for CMD_SPRITE_* requests */
+static sprite_t sprites[SPRITE_COUNT];
+/** Mask of the currently shown sprites, bit n set for sprite n */
+static uint8_t sprites_shown;
+
+/**
+ * Most areas a single request leaves behind to redraw. Moving a sprite
+ * leaves its old and new area, anything else one area at most.
+ */
+#define SPRITE_DIRTY_COUNT 2
+/** Area to redraw after a sprite change, see sprite_update() */
+typedef struct {
+    /** First column of the area */
+    uint8_t x;
+    /** First row of the area */
+    uint8_t y;
+    /** Width of the area in columns */
+    uint8_t width;
+    /** Height of the area in rows */
+    uint8_t height;
+} sprite_area_t;
+/** Areas left to redraw */
+static sprite_area_t sprite_dirty_areas[SPRITE_DIRTY_COUNT];
+/** Number of areas in sprite_dirty_areas */
+static uint8_t sprite_dirty_count;
+
+
+/**
+ * Check if a given window fits on the display.
+ *
+ * @param column_start First column of the window
+ * @param column_end Last column of the window
+ * @param page_start First page of the window
+ * @param page_end Last page of the window
+ * @return 1 if the window is valid, 0 if not
+ */
+static uint8_t
+window_valid(uint8_t column_start, uint8_t column_end, uint8_t page_start, uint8_t page_end)
+{
+    return (column_start <= column_end && column_end < display.properties.res_x &&
+            page_start <= page_end && page_end < display.properties.res_y / 8);
+}
+
+/**
+ * Set up a new window to write received data to, and start the display's
+ * frame at its top left corner.
+ *
+ * @param column_start First column of the window
+ * @param column_end Last column of the window
+ * @param page_start First page of the window, must be set in the page mask
+ * @param page_end Last page of the window
+ * @param pages Mask of pages within the window to write to, 0xff for all
+ */
+static void
+window_start(uint8_t column_start, uint8_t column_end, uint8_t page_start, uint8_t page_end,
+             uint8_t pages)
+{
+    window_column_start = column_start;
+    window_column_end = column_end;
+    window_page_start = page_start;
+    window_page_end = page_end;
+    window_pages = pages;
+    window_full_width = (column_start == 0 && column_end == display.properties.res_x - 1);
+
+    window_column = column_start;
+    window_page = page_start;
+    window_restart = 0;
+
+    display.frame_start(column_start, column_end, page_start);
+}
+
+/**
+ * Move the current window's position to a given column on its first page,
+ * restarting the display's frame there. The frame gets restarted again at
+ * the window's first column on the next page, as displays with column
+ * ranges would otherwise continue at the given column there.
+ *
+ * @param column Column to continue at, within the window
+ */
+static void
+window_seek(uint8_t column)
+{
+    display.frame_done();
+    display.frame_start(column, window_column_end, window_page);
+
+    window_column = column;
+    window_restart = 1;
+}
+
+/**
+ * Send a single byte to the display at the window's current position,
+ * and advance to the next position.
+ *
+ * After the window's last column, writing continues at its first column on
+ * the next page in the window's page mask, and after the last page, back on
+ * the first page. Unless the display itself already continues at that very
+ * position, its frame gets restarted there.
+ *
+ * Unlike window_write(), the byte isn't stored in the display's framebuffer,
+ * so it's only shown on top of the framebuffer's content.
+ *
+ * @param data Byte to send
+ */
+static void
+window_send(uint8_t data)
+{
+    uint8_t restart;
+    uint8_t page;
+
+    display.send_byte(data);
+
+    if (window_column++ == window_column_end) {
+        window_column = window_column_start;
+        restart = window_restart || !(window_full_width || display.column_wrap);
+        window_restart = 0;
+
+        page = window_page;
+        do {
+            if (page++ == window_page_end) {
+                page = window_page_start;
+            }
+        } while (!(window_pages & (1 << page)));
+
+        /* Display continues on the very next page, anything else needs a restart */
+        if (page != window_page + 1) {
+            restart = 1;
+        }
+        window_page = page;
+
+        if (restart) {
+            display.frame_done();
+            display.frame_start(window_column_start, window_column_end, window_page);
+        }
+    }
+}
+
+/**
+ * Compose a single byte of display content, i.e. the framebuffer's content
+ * with all visible sprites covering it drawn on top.
+ *
+ * Sprites don't need to be aligned to pages, so each sprite byte may get
+ * combined from two of the sprite's pages.
+ *
+ * @param column Column of the byte to compose
+ * @param page Page of the byte to compose
+ * @return Composed display byte
+ */
+static uint8_t
+sprite_compose(uint8_t column, uint8_t page)
+{
+    uint8_t data = display.framebuffer[page * display.properties.res_x + column];
+    uint8_t *image;
+    uint8_t width;
+    uint8_t height;
+    uint8_t shift;
+    uint8_t index;
+    int16_t row;
+    uint8_t i;
+
+    for (i = 0; i < SPRITE_COUNT; i++) {
+        if (!sprites[i].visible || column < sprites[i].x) {
+            continue;
+        }
+
+        image = &assets[sprites[i].offset];
+        width = image[0];
+        height = image[1];
+        /* Sprite row of the page's top-most row, may be negative */
+        row = page * 8 - sprites[i].y;
+
+        if (column - sprites[i].x >= width || row <= -8 || row >= height) {
+            continue;
+        }
+
+        /* Sprite's column within its first page */
+        image += 2 + (column - sprites[i].x);
+
+        if (row < 0) {
+            /* Sprite starts within this page */
+            data |= image[0] << -row;
+        } else {
+            /* Sprite started above, combine the two pages the rows are in */
+            index = row / 8;
+            shift = row % 8;
+            data |= image[index * width] >> shift;
+            if (shift > 0 && (index + 1) * 8 < height) {
+                data |= image[(index + 1) * width] << (8 - shift);
+            }
+        }
+    }
+
+    return data;
+}
+
+/**
+ * Write a single byte to the display at the window's current position,
+ * store it in the display's framebuffer, and advance to the next position.
+ *
+ * The framebuffer only ever holds the content beneath the sprites, so if
+ * any sprites are shown, they're drawn on top of the byte sent to the
+ * display, and new frames don't wipe them out.
+ *
+ * @param data Byte to write
+ */
+static void
+window_write(uint8_t data)
+{
+    display.framebuffer[window_page * display.properties.res_x + window_column] = data;
+    if (sprites_shown) {
+        data = sprite_compose(window_column, window_page);
+    }
+    window_send(data);
+}
+
+/**
+ * Fill the whole current window with generated data, and end the frame.
+ *
+ * @param pattern Byte to fill the window with
+ * @param invert Set to write the inverted current display content instead
+ */
+static void
+window_fill(uint8_t pattern, uint8_t invert)
+{
+    uint16_t count = (window_column_end - window_column_start + 1) *
+                     (window_page_end - window_page_start + 1);
+
+    while (count--) {
+        if (invert) {
+            pattern = ~display.framebuffer[window_page * display.properties.res_x + window_column];
+        }
+        window_write(pattern);
+    }
+
+    display.frame_done();
+}
+
+/**
+ * Store the parameters of a fill for fill_run() to run later on.
+ *
+ * @param column_start First column of the window to fill
+ * @param column_end Last column of the window to fill
+ * @param page_start First page of the window to fill
+ * @param page_end Last page of the window to fill
+ * @param pattern Byte to fill the window with
+ * @param invert Set to invert the window's current content instead
+ */
+static void
+fill_request(uint8_t column_start, uint8_t column_end, uint8_t page_start, uint8_t page_end,
+             uint8_t pattern, uint8_t invert)
+{
+    fill_column_start = column_start;
+    fill_column_end = column_end;
+    fill_page_start = page_start;
+    fill_page_end = page_end;
+    fill_pattern = pattern;
+    fill_invert = invert;
+    fill_pending = 1;
+}
+
+/**
+ * Run the pending CMD_FILL, CMD_INVERT, CMD_CLEAR, or BATCH_FILL fill, if
+ * there is one.
+ *
+ * Filling the whole display sends over a kilobyte to it, which takes far
+ * too long to do inside one of V-USB's callbacks, so fills only store their
+ * parameters with fill_request(), and the main loop calls this once usbPoll()
+ * returned.
+ */
+static void
+fill_run(void)
+{
+    if (fill_pending) {
+        fill_pending = 0;
+        window_start(fill_column_start, fill_column_end, fill_page_start, fill_page_end, 0xff);
+        window_fill(fill_pattern, fill_invert);
+    }
+}
+
+/**
+ * Decode a single byte of run-length encoded data and write the result to
+ * the display window.
+ *
+ * The decoder state is kept in between calls, so packets can be split up
+ * at any point, e.g. across the 8 byte chunks usbFunctionWrite() receives.
+ *
+ * @param data Received byte of encoded data
+ */
+static void
+rle_decode(uint8_t data)
+{
+    if (rle_count == 0) {
+        /* Packet header */
+        if (data < 128) {
+            rle_count = data + 1;
+            rle_repeat = 0;
+        } else if (data > 128) {
+            rle_count = 257 - data;
+            rle_repeat = 1;
+        }
+
+    } else if (rle_repeat) {
+        /* Byte to repeat, leave writing the run to expand() */
+        rle_byte = data;
+        rle_left = rle_count;
+        rle_count = 0;
+
+    } else {
+        /* Literal byte */
+        window_write(data);
+        rle_count--;
+    }
+}
+
+/**
+ * Get the length of a tile starting at the window's current position.
+ *
+ * Tiles never cross the window's last column, so the last tile of each
+ * page is shorter if the window's width isn't a multiple of 8.
+ *
+ * @return Tile length in bytes, 1-8
+ */
+static uint8_t
+tile_length(void)
+{
+    uint8_t left = window_column_end - window_column + 1;
+    return (left < 8) ? left : 8;
+}
+
+/**
+ * Decode a single byte of tile encoded data and write the result to the
+ * display window.
+ *
+ * Just like rle_decode(), the decoder state is kept in between calls, and
+ * writing a dictionary token's tiles is left to expand().
+ *
+ * @param data Received byte of encoded data
+ */
+static void
+tile_decode(uint8_t data)
+{
+    if (tile_count == 0) {
+        if (data >= 0xf0) {
+            /* Literal tile, its bytes follow */
+            tile_entry = data & 0x0f;
+            tile_count = tile_length();
+            tile_pos = 0;
+
+        } else {
+            /* Dictionary entry, to write the requested number of times */
+            tile_entry = data & 0x0f;
+            tile_left = (data >> 4) + 1;
+        }
+
+    } else {
+        /* Literal tile byte */
+        tiles[tile_entry][tile_pos++] = data;
+        window_write(data);
+        tile_count--;
+    }
+}
+
+/**
+ * Write the pending part of the last decoded run-length encoded repeat or
+ * tile dictionary token, up to the given limit.
+ *
+ * Dictionary tiles are always written as a whole, so the limit may be
+ * exceeded by up to 7 bytes.
+ *
+ * @param limit Number of bytes to write at most
+ * @return Number of bytes written
+ */
+static uint8_t
+expand(uint8_t limit)
+{
+    uint8_t count = 0;
+    uint8_t length;
+    uint8_t i;
+
+    while (rle_left > 0 && count < limit) {
+        window_write(rle_byte);
+        rle_left--;
+        count++;
+    }
+
+    while (tile_left > 0 && count < limit) {
+        length = tile_length();
+        for (i = 0; i < length; i++) {
+            window_write(tiles[tile_entry][i]);
+        }
+        tile_left--;
+        count += length;
+    }
+
+    return count;
+}
+
+/**
+ * Render a single character of text to the display window.
+ *
+ * Writes the character's font columns and one empty column to separate it
+ * from the next one, as long as there are columns left on the display.
+ *
+ * @param c ASCII character to render
+ */
+static void
+text_write(uint8_t c)
+{
+    uint8_t i;
+
+    if (c < FONT_FIRST || c > FONT_LAST) {
+        c = '?';
+    }
+
+    for (i = 0; i <= FONT_WIDTH && text_columns > 0; i++, text_columns--) {
+        if (i < FONT_WIDTH) {
+            window_write(pgm_read_byte(&font[(c - FONT_FIRST) * FONT_WIDTH + i]) ^ text_invert);
+        } else {
+            window_write(text_invert);
+        }
+    }
+}
+
+/**
+ * Send the pending changed byte of CMD_PIXELS requests to the display.
+ *
+ * If the display doesn't already continue at the byte's position, a new
+ * frame gets started there, ending the previous one if there was any.
+ */
+static void
+pixel_flush(void)
+{
+    uint8_t column;
+
+    if (pixel_index == PIXEL_NONE) {
+        return;
+    }
+
+    column = pixel_index % display.properties.res_x;
+
+    if (pixel_index != pixel_next) {
+        if (pixel_frame) {
+            display.frame_done();
+        }
+        pixel_frame = 1;
+        display.frame_start(column, display.properties.res_x - 1, pixel_index / display.properties.res_x);
+    }
+
+    if (sprites_shown) {
+        display.send_byte(sprite_compose(column, pixel_index / display.properties.res_x));
+    } else {
+        display.send_byte(display.framebuffer[pixel_index]);
+    }
+
+    /* After the last column, the displays disagree on where to continue */
+    pixel_next = (column == display.properties.res_x - 1) ? PIXEL_NONE : pixel_index + 1;
+    pixel_index = PIXEL_NONE;
+}
+
+/**
+ * Handle a single received byte of a CMD_PIXELS request's pixel list.
+ *
+ * Pixels change the framebuffer right away, but the changed byte is only
+ * sent to the display once a pixel in a different byte follows, or the list
+ * ends, so several pixels in the same byte are sent together.
+ *
+ * @param data Received byte, the column on even positions, the row and
+ *             value on odd ones
+ */
+static void
+pixel_write(uint8_t data)
+{
+    uint8_t row = data & 0x3f;
+    uint16_t index;
+    uint8_t mask;
+
+    if ((recv_cnt & 1) == 0) {
+        pixel_column = data;
+        return;
+    }
+
+    /* Quietly ignore pixels outside of the display */
+    if (pixel_column >= display.properties.res_x || row >= display.properties.res_y) {
+        return;
+    }
+
+    index = (row / 8) * display.properties.res_x + pixel_column;
+    if (index != pixel_index) {
+        pixel_flush();
+        pixel_index = index;
+    }
+
+    mask = 1 << (row % 8);
+    if (data & 0x80) {
+        display.framebuffer[index] |= mask;
+    } else if (data & 0x40) {
+        display.framebuffer[index] ^= mask;
+    } else {
+        display.framebuffer[index] &= ~mask;
+    }
+}
+
+/**
+ * Finish a CMD_PIXELS request, sending the last pending changed byte and
+ * ending the display's frame, if one was started at all.
+ */
+static void
+pixel_done(void)
+{
+    pixel_flush();
+
+    if (pixel_frame) {
+        display.frame_done();
+        pixel_frame = 0;
+    }
+}
+
+/**
+ * Write up to 4 bytes given in a setup packet to the display, starting at
+ * the current poke position, and advance the poke position past them.
+ * Bytes beyond the display's last column are left out.
+ *
+ * @param bytes Bytes to write
+ * @param count Number of bytes to write
+ */
+static void
+poke_write(uint8_t *bytes, uint8_t count)
+{
+    uint8_t i;
+
+    if (poke_column >= display.properties.res_x) {
+        return;
+    }
+
+    if (count > display.properties.res_x - poke_column) {
+        count = display.properties.res_x - poke_column;
+    }
+
+    window_start(poke_column, display.properties.res_x - 1, poke_page, poke_page, 0xff);
+    for (i = 0; i < count; i++) {
+        window_write(bytes[i]);
+    }
+    display.frame_done();
+
+    poke_column += count;
+}
+
+/**
+ * End the current CMD_BATCH window, if there is one, so the display is
+ * free for anything else than data.
+ */
+static void
+batch_end_window(void)
+{
+    if (batch_window) {
+        display.frame_done();
+        batch_window = 0;
+    }
+}
+
+/**
+ * Get the number of parameter bytes a CMD_BATCH sub-command has, i.e. the
+ * bytes before any data or command bytes.
+ *
+ * @param op Sub-command
+ * @return Number of parameter bytes, 0xff for unknown sub-commands
+ */
+static uint8_t
+batch_arg_count(uint8_t op)
+{
+    switch (op) {
+        case BATCH_WINDOW:
+            return 3;
+        case BATCH_DATA:
+        case BATCH_DATA_RLE:
+        case BATCH_DATA_TILE:
+            return 2;
+        case BATCH_FILL:
+        case BATCH_COMMAND:
+        case BATCH_SCROLL:
+            return 1;
+        default:
+            return 0xff;
+    }
+}
+
+/**
+ * Run the current CMD_BATCH sub-command once all its parameters arrived.
+ *
+ * Sub-commands followed by data or command bytes only get set up here,
+ * those bytes are then handled in batch_write() as they arrive. Windows
+ * that don't fit the display, and data without a window, are invalid and
+ * end the whole batch.
+ */
+static void
+batch_run(void)
+{
+    uint8_t page_start = batch_args[2] & 0x0f;
+    uint8_t page_end = batch_args[2] >> 4;
+
+    switch (batch_op) {
+        case BATCH_WINDOW:
+            batch_end_window();
+            if (window_valid(batch_args[0], batch_args[1], page_start, page_end)) {
+                window_start(batch_args[0], batch_args[1], page_start, page_end, 0xff);
+                batch_window = 1;
+            } else {
+                batch_error = 1;
+            }
+            break;
+
+        case BATCH_DATA:
+        case BATCH_DATA_RLE:
+        case BATCH_DATA_TILE:
+            batch_len = batch_args[0] | (batch_args[1] << 8);
+            batch_error = !batch_window;
+            rle_count = 0;
+            tile_count = 0;
+            break;
+
+        case BATCH_FILL:
+            /*
+             * Just like CMD_FILL, leave the fill itself to fill_run(). The
+             * window's frame is ended here, fill_run() starts its own one.
+             */
+            if (batch_window) {
+                batch_end_window();
+                fill_request(window_column_start, window_column_end,
+                             window_page_start, window_page_end, batch_args[0], 0);
+            } else {
+                batch_error = 1;
+            }
+            break;
+
+        case BATCH_COMMAND:
+            batch_end_window();
+            batch_len = batch_args[0];
+            break;
+
+        case BATCH_SCROLL:
+            batch_end_window();
+            if (display.set_start_line != NULL) {
+                display.set_start_line(batch_args[0]);
+            }
+            break;
+    }
+
+    if (batch_len == 0) {
+        batch_op = 0;
+    }
+}
+
+/**
+ * Handle a single received byte of a CMD_BATCH request's sub-command stream.
+ *
+ * @param data Received byte
+ */
+static void
+batch_write(uint8_t data)
+{
+    if (batch_error) {
+        return;
+    }
+
+    if (batch_op == 0) {
+        /* Sub-command byte, everything that follows depends on it */
+        batch_op = data;
+        batch_argc = 0;
+        if (batch_arg_count(batch_op) == 0xff) {
+            batch_error = 1;
+        }
+
+    } else if (batch_argc < batch_arg_count(batch_op)) {
+        /* Parameter byte, run the sub-command once it has them all */
+        batch_args[batch_argc++] = data;
+        if (batch_argc == batch_arg_count(batch_op)) {
+            batch_run();
+        }
+
+    } else {
+        /* Data or command byte */
+        if (batch_op == BATCH_DATA_RLE) {
+            rle_decode(data);
+        } else if (batch_op == BATCH_DATA_TILE) {
+            tile_decode(data);
+        } else if (batch_op == BATCH_COMMAND) {
+            display.command(data);
+        } else {
+            window_write(data);
+        }
+
+        if (--batch_len == 0) {
+            batch_op = 0;
+        }
+    }
+}
+
+/**
+ * Check if the asset pool holds a valid animation at a given offset, i.e.
+ * its window fits the display, and all its frames fit the asset pool.
+ *
+ * @param offset Asset pool offset of the animation's header
+ * @return 1 if the animation is valid, 0 if not
+ */
+static uint8_t
+animation_valid(uint16_t offset)
+{
+    uint8_t frames;
+
+    if (offset + 4 > ASSET_SIZE) {
+        return 0;
+    }
+
+    if (!window_valid(assets[offset], assets[offset + 1],
+                      assets[offset + 2] & 0x0f, assets[offset + 2] >> 4) || assets[offset + 3] == 0) {
+        return 0;
+    }
+
+    frames = assets[offset + 3];
+    offset += 4;
+
+    while (frames--) {
+        if (offset + 2 > ASSET_SIZE) {
+            return 0;
+        }
+        offset += 2 + (assets[offset] | (assets[offset + 1] << 8));
+        if (offset > ASSET_SIZE) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Show the running animation's next frame.
+ *
+ * The frame is decoded straight from the asset pool to the display, using
+ * the same window and decoder as received CMD_DATA_RLE data, so this must
+ * not be called while any data transfer is ongoing.
  */
-#define CMD_DATA    0x20
-/** Reset the display to its initial state */
-#define CMD_RESET   0xf0
-/** BYE Request, host gracefully disconnects */
-#define CMD_BYE     0xaa
+static void
+animation_step(void)
+{
+    uint8_t *header = &assets[anim_offset];
+    uint16_t length;
 
-/** Idle state, device is waiting for new connections */
-#define ST_IDLE     0
-/** Ready state, device has a connection and is ready to receive image data */
-#define ST_READY    1
-/** The current state the device is in, ST_IDLE or ST_READY */
-uint8_t state = ST_IDLE;
+    if (anim_frames == 0) {
+        anim_frames = header[3];
+        anim_pos = anim_offset + 4;
+    }
 
-/** CMD_HELLO expected wValue parameter */
-#define HELLO_VALUE 0x4d6f
-/** CMD_HELLO expected wIndex parameter */
-#define HELLO_INDEX 0x6921
-/* ..adding up to ASCII of the Finnish greeting 'Moi!' */
+    length = assets[anim_pos] | (assets[anim_pos + 1] << 8);
+    anim_pos += 2;
 
-/** Number of bytes to expect from the CMD_DATA request */
-static uint16_t recv_len;
-/** Bytes received during the CMD_DATA request's data transfer */
-static uint16_t recv_cnt;
+    window_start(header[0], header[1], header[2] & 0x0f, header[2] >> 4, 0xff);
+    rle_count = 0;
+    while (length--) {
+        rle_decode(assets[anim_pos++]);
+        /* No V-USB callback to return from here, so expand it all at once */
+        expand(0xff);
+    }
+    display.frame_done();
+
+    anim_frames--;
+}
+
+/**
+ * Check if the asset pool holds a valid sprite image at a given offset.
+ *
+ * @param offset Asset pool offset of the sprite image
+ * @return 1 if the sprite image is valid, 0 if not
+ */
+static uint8_t
+sprite_valid(uint16_t offset)
+{
+    uint8_t width;
+    uint8_t height;
+
+    if (offset + 2 > ASSET_SIZE) {
+        return 0;
+    }
+
+    width = assets[offset];
+    height = assets[offset + 1];
+
+    return (width > 0 && height > 0 &&
+            offset + 2 + width * ((height + 7) / 8) <= ASSET_SIZE);
+}
+
+/**
+ * Redraw a rectangular area of the display with the sprites on top of it.
+ * The area gets clipped to the display, and is given in pixel rows, so it
+ * covers all the pages those rows are in.
+ *
+ * @param x First column of the area
+ * @param y First row of the area
+ * @param width Width of the area in columns
+ * @param height Height of the area in rows
+ */
+static void
+sprite_redraw(uint8_t x, uint8_t y, uint16_t width, uint16_t height)
+{
+    uint8_t column_end;
+    uint8_t page_end;
+    uint8_t column;
+    uint8_t page;
+
+    if (x >= display.properties.res_x || y >= display.properties.res_y) {
+        return;
+    }
+
+    column_end = (x + width > display.properties.res_x) ? display.properties.res_x - 1 : x + width - 1;
+    page_end = (y + height > display.properties.res_y) ? display.properties.res_y / 8 - 1 : (y + height - 1) / 8;
+
+    window_start(x, column_end, y / 8, page_end, 0xff);
+    for (page = y / 8; page <= page_end; page++) {
+        for (column = x; column <= column_end; column++) {
+            window_send(sprite_compose(column, page));
+        }
+    }
+    display.frame_done();
+}
+
+/**
+ * Mark an area of the display to be redrawn by sprite_update().
+ *
+ * The area is clipped to the display, see sprite_redraw() for the rest.
+ *
+ * @param x First column of the area
+ * @param y First row of the area
+ * @param width Width of the area in columns
+ * @param height Height of the area in rows
+ */
+static void
+sprite_dirty(uint8_t x, uint8_t y, uint16_t width, uint16_t height)
+{
+    sprite_area_t *area = &sprite_dirty_areas[sprite_dirty_count++];
+
+    area->x = x;
+    area->y = y;
+    area->width = (width > display.properties.res_x) ? display.properties.res_x : width;
+    area->height = (height > display.properties.res_y) ? display.properties.res_y : height;
+}
+
+/**
+ * Redraw all areas sprite changes left behind.
+ *
+ * Redrawing a sprite's area sends up to a whole display's worth of data, so
+ * just like fills, it's done from the main loop instead of within
+ * usbFunctionSetup(), and the requests only mark the areas with
+ * sprite_dirty(). The sprites themselves are changed right away though.
+ */
+static void
+sprite_update(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < sprite_dirty_count; i++) {
+        sprite_redraw(sprite_dirty_areas[i].x, sprite_dirty_areas[i].y,
+                      sprite_dirty_areas[i].width, sprite_dirty_areas[i].height);
+    }
+    sprite_dirty_count = 0;
+}
+
+/**
+ * Move a sprite to a new position and show it there, and mark the area it
+ * was previously shown at to be redrawn, too.
+ *
+ * If both areas are close enough that the rectangle around them both isn't
+ * larger than both areas together, that rectangle is redrawn in one go.
+ * Anything beyond the display is cut off from that rectangle first, which
+ * also keeps its size from overflowing.
+ *
+ * @param sprite Sprite to move
+ * @param x Column of the sprite's new top left corner
+ * @param y Row of the sprite's new top left corner
+ */
+static void
+sprite_move(sprite_t *sprite, uint8_t x, uint8_t y)
+{
+    uint8_t width = assets[sprite->offset];
+    uint8_t height = assets[sprite->offset + 1];
+    uint8_t old_x = sprite->x;
+    uint8_t old_y = sprite->y;
+    uint8_t was_visible = sprite->visible;
+    uint8_t min_x = (x < old_x) ? x : old_x;
+    uint8_t min_y = (y < old_y) ? y : old_y;
+    uint16_t union_width = ((x > old_x) ? x : old_x) + width - min_x;
+    uint16_t union_height = ((y > old_y) ? y : old_y) + height - min_y;
+
+    if (union_width > display.properties.res_x) {
+        union_width = display.properties.res_x;
+    }
+    if (union_height > display.properties.res_y) {
+        union_height = display.properties.res_y;
+    }
+
+    sprite->x = x;
+    sprite->y = y;
+    sprite->visible = 1;
+    sprites_shown |= 1 << (sprite - sprites);
+
+    if (!was_visible) {
+        sprite_dirty(x, y, width, height);
+    } else if (union_width * union_height <= 2 * width * height) {
+        sprite_dirty(min_x, min_y, union_width, union_height);
+    } else {
+        sprite_dirty(old_x, old_y, width, height);
+        sprite_dirty(x, y, width, height);
+    }
+}
+
+/**
+ * Hide a sprite, and mark the area it was shown at to be redrawn.
+ *
+ * @param sprite Sprite to hide
+ */
+static void
+sprite_hide(sprite_t *sprite)
+{
+    if (sprite->visible) {
+        sprite->visible = 0;
+        sprites_shown &= ~(1 << (sprite - sprites));
+        sprite_dirty(sprite->x, sprite->y, assets[sprite->offset], assets[sprite->offset + 1]);
+    }
+}
+
+/**
+ * Finish the current data transfer.
+ *
+ * Assets never started a frame in the first place, so there's nothing to
+ * finish then, and pixel lists and batches only did if they had anything
+ * to send. For everything else, call the display's frame_done() callback.
+ */
+static void
+recv_done(void)
+{
+    if (recv_request == CMD_PIXELS) {
+        pixel_done();
+    } else if (recv_request == CMD_BATCH) {
+        batch_end_window();
+    } else if (recv_request != CMD_ASSET) {
+        display.frame_done();
+    }
+}
+
+/**
+ * Process the bytes of the last received chunk, until either all of them
+ * are done, expanding the encoded ones took EXPAND_MAX bytes and some more
+ * are still left to write, or a BATCH_FILL needs to run before the rest.
+ * Finishes the transfer after its last chunk.
+ *
+ * Forwards the received data to the display window, which ends up in the
+ * display's send_byte() callback function, or wherever else the current
+ * request's data goes.
+ *
+ * @return 1 if the chunk is done, 0 if it needs to be continued later on
+ */
+static uint8_t
+recv_continue(void)
+{
+    uint8_t written = 0;
+    uint8_t data;
+
+    /* A fill the chunk's processing stopped at comes first */
+    fill_run();
+
+    while (1) {
+        /* Write what's left of the last decoded byte, as far as possible */
+        if (written < EXPAND_MAX) {
+            written += expand(EXPAND_MAX - written);
+        }
+        if (rle_left > 0 || tile_left > 0) {
+            return 0;
+        }
+
+        if (recv_chunk_pos == recv_chunk_len) {
+            break;
+        }
+
+        /*
+         * A BATCH_FILL has to be done before the following bytes, but it's
+         * too much for one go, so stop here. If it was the chunk's last
+         * byte, there's no need for that, the main loop runs it anyway.
+         */
+        if (fill_pending) {
+            return 0;
+        }
+
+        data = recv_chunk[recv_chunk_pos++];
+        if (recv_request == CMD_DATA_RLE) {
+            rle_decode(data);
+        } else if (recv_request == CMD_DATA_TILE) {
+            tile_decode(data);
+        } else if (recv_request == CMD_TEXT) {
+            text_write(data);
+        } else if (recv_request == CMD_ASSET) {
+            assets[asset_pos++] = data;
+        } else if (recv_request == CMD_PIXELS) {
+            pixel_write(data);
+        } else if (recv_request == CMD_BATCH) {
+            batch_write(data);
+        } else {
+            window_write(data);
+        }
+        recv_cnt++;
+    }
+
+    /* If all expected number of bytes for this frame was received, finish it */
+    if (recv_cnt == recv_len) {
+        recv_done();
+    }
+
+    return 1;
+}
 
 
 /**
@@ -99,6 +1447,27 @@ usbFunctionSetup(uchar data[8])
 {
     /* Cast given raw data to usbRequest_t structure */
     usbRequest_t *rq = (void *) data;
+    uint8_t pages;
+    uint8_t page_start;
+    uint8_t page_end;
+    uint8_t poke[4];
+    uint8_t i;
+
+    /*
+     * A new request always ends the previous data transfer. If the host
+     * aborted that one halfway through, finish its frame now and forget
+     * about it, otherwise the main loop would keep waiting for the rest
+     * of it and never step the animation again.
+     */
+    if (recv_cnt < recv_len) {
+        recv_done();
+    }
+    recv_cnt = 0;
+    recv_len = 0;
+
+    /* Same for a pending fill or sprite redraw, they must come before anything new */
+    fill_run();
+    sprite_update();
 
     switch (rq->bRequest) {
         case CMD_HELLO:
@@ -119,9 +1488,14 @@ usbFunctionSetup(uchar data[8])
                  * properly disconnecting. Just in case, re-initialize the
                  * display by calling its init() callback before proceeding.
                  *
+                 * Otherwise, a previous host may still have left the display
+                 * scrolled, while a new host expects display RAM and display
+                 * rows to match, so reset the start line.
                  */
                 if (state != ST_IDLE) {
                     display.init();
+                } else if (display.set_start_line != NULL) {
+                    display.set_start_line(0);
                 }
 
                 /*
@@ -153,9 +1527,11 @@ usbFunctionSetup(uchar data[8])
             /*
              * DATA Request - Host sends a new frame of image data
              *
-             * Also here, device must be in READY state..
+             * Also here, device must be in READY state, and the start
+             * position on the display..
              */
-            if (state == ST_READY) {
+            if (state == ST_READY && rq->wValue.bytes[0] < display.properties.res_x &&
+                    rq->wValue.bytes[1] < display.properties.res_y / 8) {
                 /*
                  * ..which it is.
                  *
@@ -164,13 +1540,19 @@ usbFunctionSetup(uchar data[8])
                  */
                 recv_cnt = 0;
                 recv_len = rq->wLength.word;
+                recv_request = CMD_DATA;
 
                 /*
-                 * Call the display's frame_start() callback function which
-                 * should set the display in a state that it's ready to
-                 * receive a full frame of raw image data to display
+                 * Set up a window covering the whole display from the start
+                 * page on, which calls the display's frame_start() callback
+                 * function that should set the display in a state that it's
+                 * ready to receive a full frame of raw image data to display
                  */
-                display.frame_start();
+                window_start(0, display.properties.res_x - 1, rq->wValue.bytes[1],
+                             display.properties.res_y / 8 - 1, 0xff);
+                if (rq->wValue.bytes[0] > 0) {
+                    window_seek(rq->wValue.bytes[0]);
+                }
 
                 /*
                  * Return special USB_NO_MSG value to indicate to V-USB that
@@ -181,6 +1563,264 @@ usbFunctionSetup(uchar data[8])
             }
             break;
 
+        case CMD_WINDOW:
+        case CMD_DATA_RLE:
+        case CMD_DATA_TILE:
+            /*
+             * WINDOW / DATA_RLE / DATA_TILE Request - Host sends a part of
+             * a frame of image data, either raw, run-length, or tile encoded
+             *
+             * Same as DATA, as long as the requested window fits the display.
+             */
+            if (state == ST_READY && window_valid(rq->wValue.bytes[0], rq->wValue.bytes[1],
+                                                  rq->wIndex.bytes[0], rq->wIndex.bytes[1])) {
+                recv_cnt = 0;
+                recv_len = rq->wLength.word;
+                recv_request = rq->bRequest;
+                rle_count = 0;
+                tile_count = 0;
+
+                window_start(rq->wValue.bytes[0], rq->wValue.bytes[1],
+                             rq->wIndex.bytes[0], rq->wIndex.bytes[1], 0xff);
+
+                return USB_NO_MSG;
+            }
+            break;
+
+        case CMD_PAGES:
+            /*
+             * PAGES Request - Host sends a subset of the display's pages,
+             * encoded like the request given in wIndex
+             *
+             * Make sure the page mask isn't empty and doesn't go beyond the
+             * display's last page, and the encoding is a known one.
+             */
+            pages = rq->wValue.bytes[0];
+            if (state == ST_READY && pages != 0 && rq->wValue.bytes[1] == 0 &&
+                    (pages >> (display.properties.res_y / 8)) == 0 &&
+                    (rq->wIndex.word == CMD_WINDOW || rq->wIndex.word == CMD_DATA_RLE ||
+                     rq->wIndex.word == CMD_DATA_TILE)) {
+                recv_cnt = 0;
+                recv_len = rq->wLength.word;
+                recv_request = rq->wIndex.bytes[0];
+                rle_count = 0;
+                tile_count = 0;
+
+                /* Window spans from the lowest to the highest page in the mask */
+                for (page_start = 0; !(pages & (1 << page_start)); page_start++)
+                    ;
+                for (page_end = 7; !(pages & (1 << page_end)); page_end--)
+                    ;
+
+                window_start(0, display.properties.res_x - 1, page_start, page_end, pages);
+
+                return USB_NO_MSG;
+            }
+            break;
+
+        case CMD_PIXELS:
+            /*
+             * PIXELS Request - Host sends a list of single pixels to change
+             *
+             * Each pixel takes 2 bytes, so the list can't have an odd length.
+             * Pixels outside of the display are simply ignored.
+             */
+            if (state == ST_READY && rq->wLength.word > 0 && (rq->wLength.word & 1) == 0) {
+                recv_cnt = 0;
+                recv_len = rq->wLength.word;
+                recv_request = CMD_PIXELS;
+                pixel_index = PIXEL_NONE;
+                pixel_next = PIXEL_NONE;
+                pixel_frame = 0;
+
+                return USB_NO_MSG;
+            }
+            break;
+
+        case CMD_POKE:
+            /*
+             * POKE Request - Host writes 2 bytes at a given position
+             *
+             * Everything is in the setup packet, so there's no data transfer,
+             * the position just needs to be on the display.
+             */
+            if (state == ST_READY && window_valid(rq->wValue.bytes[0], rq->wValue.bytes[0],
+                                                  rq->wValue.bytes[1], rq->wValue.bytes[1])) {
+                poke_column = rq->wValue.bytes[0];
+                poke_page = rq->wValue.bytes[1];
+                poke_write(rq->wIndex.bytes, 2);
+            }
+            break;
+
+        case CMD_POKE_NEXT:
+            /*
+             * POKE_NEXT Request - Host writes 4 more bytes after the previous ones
+             *
+             * Needs a preceding CMD_POKE request to know where to write them.
+             */
+            if (state == ST_READY && poke_page != 0xff) {
+                poke[0] = rq->wValue.bytes[0];
+                poke[1] = rq->wValue.bytes[1];
+                poke[2] = rq->wIndex.bytes[0];
+                poke[3] = rq->wIndex.bytes[1];
+                poke_write(poke, 4);
+            }
+            break;
+
+        case CMD_BATCH:
+            /*
+             * BATCH Request - Host sends a stream of sub-commands
+             *
+             * Everything is handled as the stream arrives, so just make sure
+             * there is a stream at all.
+             */
+            if (state == ST_READY && rq->wLength.word > 0) {
+                recv_cnt = 0;
+                recv_len = rq->wLength.word;
+                recv_request = CMD_BATCH;
+                batch_op = 0;
+                batch_len = 0;
+                batch_window = 0;
+                batch_error = 0;
+
+                return USB_NO_MSG;
+            }
+            break;
+
+        case CMD_SCROLL:
+            /*
+             * SCROLL Request - Host sets the display start line
+             *
+             * Device must be in ST_READY state, and the display needs to
+             * support it, of course.
+             */
+            if (state == ST_READY && display.set_start_line != NULL &&
+                    rq->wValue.word < display.properties.res_y) {
+                display.set_start_line(rq->wValue.bytes[0]);
+            }
+            break;
+
+        case CMD_TEXT:
+            /*
+             * TEXT Request - Host sends a text to render
+             *
+             * Device must be in ST_READY state, the text must start
+             * somewhere on the display, and not be empty, since there'd be
+             * no data transfer to end the frame again then.
+             */
+            if (state == ST_READY && rq->wValue.bytes[0] < display.properties.res_x &&
+                    rq->wValue.bytes[1] < display.properties.res_y / 8 && rq->wLength.word > 0) {
+                recv_cnt = 0;
+                recv_len = rq->wLength.word;
+                recv_request = CMD_TEXT;
+                text_columns = display.properties.res_x - rq->wValue.bytes[0];
+                text_invert = (rq->wIndex.word == 1) ? 0xff : 0x00;
+
+                /* Single page window from the start column to the last one */
+                window_start(rq->wValue.bytes[0], display.properties.res_x - 1,
+                             rq->wValue.bytes[1], rq->wValue.bytes[1], 0xff);
+
+                return USB_NO_MSG;
+            }
+            break;
+
+        case CMD_FILL:
+        case CMD_INVERT:
+            /*
+             * FILL / INVERT Request - Host requests to fill or invert a
+             * rectangular area of the display
+             *
+             * All the data is generated on the device, so there's no data
+             * transfer, just the window needs to fit the display. The fill
+             * itself is left to the main loop, see fill_run().
+             */
+            page_start = rq->wIndex.bytes[0] & 0x0f;
+            page_end = rq->wIndex.bytes[0] >> 4;
+            if (state == ST_READY && window_valid(rq->wValue.bytes[0], rq->wValue.bytes[1],
+                                                  page_start, page_end)) {
+                fill_request(rq->wValue.bytes[0], rq->wValue.bytes[1], page_start, page_end,
+                             rq->wIndex.bytes[1], (rq->bRequest == CMD_INVERT));
+            }
+            break;
+
+        case CMD_CLEAR:
+            /*
+             * CLEAR Request - Host requests to clear the whole display
+             *
+             * Same as filling the whole display with zeros, in the main loop.
+             */
+            if (state == ST_READY) {
+                fill_request(0, display.properties.res_x - 1, 0, display.properties.res_y / 8 - 1,
+                             0x00, 0);
+            }
+            break;
+
+        case CMD_ASSET:
+            /*
+             * ASSET Request - Host uploads data to the asset pool
+             *
+             * Device must be in ST_READY state, and the data must fit.
+             */
+            if (state == ST_READY && rq->wValue.word + rq->wLength.word <= ASSET_SIZE) {
+                recv_cnt = 0;
+                recv_len = rq->wLength.word;
+                recv_request = CMD_ASSET;
+                asset_pos = rq->wValue.word;
+                anim_interval = 0;
+
+                return USB_NO_MSG;
+            }
+            break;
+
+        case CMD_ANIMATE:
+            /*
+             * ANIMATE Request - Host starts or stops an animation
+             *
+             * Starting it requires a valid animation at the given offset,
+             * stopping it works regardless.
+             */
+            if (state == ST_READY) {
+                if (rq->wIndex.word == 0) {
+                    anim_interval = 0;
+                } else if (animation_valid(rq->wValue.word)) {
+                    anim_offset = rq->wValue.word;
+                    anim_frames = 0;
+                    anim_elapsed = 0;
+                    anim_interval = rq->wIndex.word;
+                }
+            }
+            break;
+
+        case CMD_SPRITE_SET:
+            /*
+             * SPRITE_SET Request - Host defines a sprite's image
+             *
+             * The sprite number must exist, and the image be valid.
+             */
+            if (state == ST_READY && rq->wIndex.word < SPRITE_COUNT && sprite_valid(rq->wValue.word)) {
+                sprite_hide(&sprites[rq->wIndex.word]);
+                sprites[rq->wIndex.word].offset = rq->wValue.word;
+            }
+            break;
+
+        case CMD_SPRITE_MOVE:
+        case CMD_SPRITE_HIDE:
+            /*
+             * SPRITE_MOVE / SPRITE_HIDE Request - Host moves or hides a sprite
+             *
+             * The sprite must have been defined before, and its image still
+             * be valid, as the asset pool may have been overwritten since.
+             */
+            if (state == ST_READY && rq->wIndex.word < SPRITE_COUNT &&
+                    sprite_valid(sprites[rq->wIndex.word].offset)) {
+                if (rq->bRequest == CMD_SPRITE_MOVE) {
+                    sprite_move(&sprites[rq->wIndex.word], rq->wValue.bytes[0], rq->wValue.bytes[1]);
+                } else {
+                    sprite_hide(&sprites[rq->wIndex.word]);
+                }
+            }
+            break;
+
         case CMD_RESET:
             /*
              * RESET Request - Re-initialize the display
@@ -188,6 +1828,12 @@ usbFunctionSetup(uchar data[8])
              * Device must be again in ST_READY state for this.
              */
             if (state == ST_READY) {
+                anim_interval = 0;
+                poke_page = 0xff;
+                for (i = 0; i < SPRITE_COUNT; i++) {
+                    sprites[i].visible = 0;
+                }
+                sprites_shown = 0;
                 display.init();
             }
             break;
@@ -212,10 +1858,17 @@ usbFunctionSetup(uchar data[8])
  * Called when the *host writes data to the device*, so in other words,
  * us being the device here, called when data is received from the host.
  *
- * This is executed as part of the CMD_DATA request and receives raw image
- * data to send straight as-is to the display.
+ * This is executed as part of the CMD_DATA, CMD_WINDOW, CMD_DATA_RLE, and
+ * CMD_DATA_TILE requests and receives image data to send to the display
+ * window, either straight as-is, or decoded on the fly if it's encoded.
+ * For CMD_TEXT requests, it receives the text to render instead, for
+ * CMD_ASSET requests the data to store in the asset pool, for CMD_PIXELS
+ * requests the list of pixels to change, and for CMD_BATCH requests the
+ * sub-command stream.
  *
  * Note that data isn't received all at once but in chunks of (max) 8 bytes.
+ * If a chunk other than the last one expands to more than EXPAND_MAX bytes,
+ * its processing continues in the main loop, see recv_continue().
  *
  * @param data Pointer where to received data sent from the host is stored
  * @param len Number of bytes received in this single chunk
@@ -224,26 +1877,41 @@ usbFunctionSetup(uchar data[8])
 uchar
 usbFunctionWrite(uchar *data, uchar len)
 {
-    uint8_t i;
+    uint8_t last;
 
-    /*
-     * Forward the received data as-is to the display via its send_byte()
-     * callback function and keep track of the amount of received bytes
-     */
-    for (i = 0; recv_cnt < recv_len && i < len; i++, recv_cnt++) {
-        display.send_byte(data[i]);
+    /* Check if this is the last chunk before anything gets processed */
+    last = (len >= recv_len - recv_cnt);
+
+    /* Keep a copy of the chunk, V-USB reuses its buffer once we return */
+    if (last) {
+        len = recv_len - recv_cnt;
     }
+    memcpy(recv_chunk, data, len);
+    recv_chunk_len = len;
+    recv_chunk_pos = 0;
 
     /*
-     * If all expected number of bytes for this frame was received,
-     * call the display's frame_done() callback.
+     * Process the chunk. If that needs to be continued in the main loop,
+     * hold off any further data from the host until it's done.
+     *
+     * Not so for the last chunk though. Returning 1 completes the transfer,
+     * so the host goes on with its next request, and V-USB would NAK that
+     * request's SETUP data while further data is held off. The last chunk
+     * is therefore always processed in full right here, which is up to 8
+     * tokens' worth of expansion, or a BATCH_FILL followed by more
+     * sub-commands, i.e. a full display frame at worst.
      */
-    if (recv_cnt == recv_len) {
-        display.frame_done();
+    if (last) {
+        while (!recv_continue()) {
+            /* Keep going until it's all written */
+        }
+    } else if (!recv_continue()) {
+        recv_pending = 1;
+        usbDisableAllRequests();
     }
 
     /* Notify V-USB if we expected more data to come or not */
-    return (recv_cnt == recv_len);
+    return last;
 }
 
 /*
@@ -259,6 +1927,15 @@ main(void) {
     _delay_ms(300);
     usbDeviceConnect();
 
+    /*
+     * Set up Timer1 in CTC mode with a 1ms period (12MHz / 64 / 187) as
+     * time base for animations. Only its compare match flag is polled,
+     * no interrupt is used, so V-USB's timing stays unaffected.
+     */
+    TCCR1A = 0;
+    TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
+    OCR1A = (F_CPU / 64 / 1000) - 1;
+
     /* Initialize USB and enable interrupts */
     usbInit();
     sei();
@@ -266,6 +1943,30 @@ main(void) {
     while (1) {
         /* Poll USB forever */
         usbPoll();
+
+        /* Continue processing the data usbFunctionWrite() left behind */
+        if (recv_pending && recv_continue()) {
+            recv_pending = 0;
+            usbEnableAllRequests();
+        }
+
+        /* Run a fill request or sprite redraw usbFunctionSetup() left behind */
+        fill_run();
+        sprite_update();
+
+        /*
+         * Count the milliseconds and show the next animation frame when
+         * it's time, unless a data transfer is currently ongoing, in which
+         * case it's shown right after that.
+         */
+        if (TIFR1 & _BV(OCF1A)) {
+            TIFR1 = _BV(OCF1A);
+            if (anim_interval > 0 && ++anim_elapsed >= anim_interval &&
+                    recv_cnt == recv_len && !recv_pending) {
+                anim_elapsed = 0;
+                animation_step();
+            }
+        }
     }
 
     return 0;
@@ -23,6 +23,7 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+#include <stddef.h>
 #include <stdint.h>
 #include <avr/pgmspace.h>
 #include <avr/io.h>
@@ -35,6 +36,9 @@
 /** LCD Y resolution, i.e. display height, in pixels */
 #define Y_RES 48
 
+/** Shadow copy of the display RAM, see display_t */
+static uint8_t framebuffer[X_RES * (Y_RES / 8)];
+
 /** LCD reset pin data direction register */
 #define LCD_RESET_DDR  DDRB
 /** LCD reset pin port register */
@@ -166,7 +170,8 @@ nokia5110_init(void)
     lcd_data_mode();
 
     for (i = 0; i < X_RES * (Y_RES / 8); i++) {
-        spi_send_byte(pgm_read_byte(&(nokia_gfx_nokia_splash[i])));
+        framebuffer[i] = pgm_read_byte(&nokia_gfx_nokia_splash[i]);
+        spi_send_byte(framebuffer[i]);
     }
 
     lcd_spi_disable();
@@ -174,14 +179,22 @@ nokia5110_init(void)
 
 /**
  * Nokia 5110 LCD start frame part.
+ *
+ * The PCD8544 has no column ranges, so the last column is ignored here.
+ *
+ * @param column Column (X address) to start at
+ * @param column_end Last column of the frame part
+ * @param page Page (Y address) to start at
  */
 void
-nokia5110_frame_start(void)
+nokia5110_frame_start(uint8_t column, uint8_t column_end, uint8_t page)
 {
+    (void) column_end;
+
     lcd_spi_enable();
     lcd_command_mode();
-    spi_send_byte(0x80); /* set X address to 0 */
-    spi_send_byte(0x40); /* set Y address to 0 */
+    spi_send_byte(0x80 | column); /* set X address */
+    spi_send_byte(0x40 | page); /* set Y address */
     lcd_data_mode();
 }
 
@@ -194,6 +207,20 @@ nokia5110_frame_done(void)
     lcd_spi_disable();
 }
 
+/**
+ * Nokia 5110 LCD send command.
+ *
+ * @param command Command byte to send
+ */
+void
+nokia5110_command(uint8_t command)
+{
+    lcd_spi_enable();
+    lcd_command_mode();
+    spi_send_byte(command);
+    lcd_spi_disable();
+}
+
 
 /** Display struct for the Nokia 5110 LCD */
 display_t display = {
@@ -201,11 +228,16 @@ display_t display = {
     .frame_start = nokia5110_frame_start,
     .send_byte = spi_send_byte,
     .frame_done = nokia5110_frame_done,
+    .command = nokia5110_command,
+    .column_wrap = 0,
+    .set_start_line = NULL,
+    .framebuffer = framebuffer,
     .properties = {
         .res_x = X_RES,
         .res_y = Y_RES,
         .color_bits = 1,
-        .identifier = "Nokia 5110"
+        .identifier = "Nokia 5110",
+        .features = 0
     }
 };
 
@@ -36,13 +36,16 @@
 /** OLED Y resolution, i.e. display height, in pixels */
 #define Y_RES  64
 
+/** Shadow copy of the display RAM, see display_t */
+static uint8_t framebuffer[X_RES * (Y_RES / 8)];
+
 /** OLED TWI address (actual address, shifting happens internally) */
 #define SSD1306_ADDR 0x3c
 
 /** TWI clock speed in Hz */
 #define F_SCL 400000UL
 
-void ssd1306_init_send(void);
+void ssd1306_init_send(uint8_t column, uint8_t column_end, uint8_t page);
 
 
 /**
@@ -181,31 +184,77 @@ ssd1306_init(void)
     twi_stop();
 
     /* Send the splash screen */
-    ssd1306_init_send();
+    ssd1306_init_send(0, X_RES - 1, 0);
     for (i = 0; i < X_RES * (Y_RES / 8); i++) {
-        twi_send_byte(pgm_read_byte(&ssd1306_gfx_ssd1306_splash[i]));
+        framebuffer[i] = pgm_read_byte(&ssd1306_gfx_ssd1306_splash[i]);
+        twi_send_byte(framebuffer[i]);
     }
     twi_stop();
 }
 
 /**
  * SSD1306 OLED start frame part.
+ *
+ * Sets the column range to the given columns, and the page range from the
+ * given page to the last one, so data wraps within the column range from
+ * one page to the next.
+ *
+ * @param column Column (X position) to start at
+ * @param column_end Last column of the frame part
+ * @param page Page (Y position) to start at
  */
 void
-ssd1306_init_send(void)
+ssd1306_init_send(uint8_t column, uint8_t column_end, uint8_t page)
 {
     twi_start();
     twi_send_byte(0x00); /* Command mode */
-    twi_send_byte(0xb0); /* Set Y position to 0 */
-    twi_send_byte(0x21);
-    twi_send_byte(0x00); /* Set X position to 0 */
-    twi_send_byte(0x7f);
+    twi_send_byte(0x21); /* Set column range.. */
+    twi_send_byte(column);     /* ..from X position */
+    twi_send_byte(column_end); /* ..to last X position */
+    twi_send_byte(0x22); /* Set page range.. */
+    twi_send_byte(page);           /* ..from Y position */
+    twi_send_byte(Y_RES / 8 - 1);  /* ..to last page */
     twi_stop();
 
     twi_start();
     twi_send_byte(0x40); /* Data mode */
 }
 
+/**
+ * SSD1306 OLED set display start line.
+ *
+ * The display's top row shows the given RAM row, and all other rows follow
+ * from there, wrapping around at the last one, so changing it scrolls the
+ * whole display content vertically without sending any of it again.
+ *
+ * @param line RAM row to show in the top row, 0-63
+ */
+void
+ssd1306_set_start_line(uint8_t line)
+{
+    twi_start();
+    twi_send_byte(0x00); /* Command mode */
+    twi_send_byte(0x40 | (line & 0x3f)); /* Set display start line */
+    twi_stop();
+}
+
+/**
+ * SSD1306 OLED send command.
+ *
+ * Each command byte is sent in its own transmission, which works for the
+ * parameter bytes of multi-byte commands as well.
+ *
+ * @param command Command byte to send
+ */
+void
+ssd1306_command(uint8_t command)
+{
+    twi_start();
+    twi_send_byte(0x00); /* Command mode */
+    twi_send_byte(command);
+    twi_stop();
+}
+
 
 /** Display struct for the SSD1306 OLED */
 display_t display = {
@@ -213,11 +262,17 @@ display_t display = {
     .frame_start = ssd1306_init_send,
     .send_byte = twi_send_byte,
     .frame_done = twi_stop,
+    .command = ssd1306_command,
+    .column_wrap = 1,
+    .set_start_line = ssd1306_set_start_line,
+    .framebuffer = framebuffer,
     .properties = {
         .res_x = X_RES,
         .res_y = Y_RES,
         .color_bits = 1,
-        .identifier = "SSD1306 OLED"
+        .identifier = "SSD1306 OLED",
+        /* Start line wraps around the full 64 rows of display RAM */
+        .features = (Y_RES == 64) ? DISPLAY_FEATURE_START_LINE : 0
     }
 };
 
@@ -0,0 +1,446 @@
+#!/usr/bin/env python3
+#
+# usbxbm - XBM to LCD by USB
+# Host-side Benchmark
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+import io
+import sys
+import time
+import argparse
+import cv2
+import numpy as np
+from PIL import Image
+
+import usbxbm
+
+# Display resolutions as reported by the device's CMD_PROPS request
+DISPLAYS = {
+    'nokia5110': (84, 48),
+    'ssd1306': (128, 64),
+}
+
+
+def parse_args():
+    """
+    Parse all command line parameters
+
+    Returns:
+    argparse.Namespace: object containing all parsed values
+    """
+    parser = argparse.ArgumentParser(
+            description='usbxbm host-side benchmark, runs without any USB device attached')
+
+    parser.add_argument(
+            '-n', '--frames',
+            metavar='COUNT',
+            type=int,
+            default=500,
+            help='Number of frames to process per benchmark, default 500')
+
+    parser.add_argument(
+            '-W', '--width',
+            metavar='PIXELS',
+            type=int,
+            default=640,
+            help='Width of the generated source frames, default 640')
+
+    parser.add_argument(
+            '-H', '--height',
+            metavar='PIXELS',
+            type=int,
+            default=480,
+            help='Height of the generated source frames, default 480')
+
+    parser.add_argument(
+            '-t', '--threshold',
+            metavar='[0-255]',
+            type=int,
+            default=128,
+            help='Set color threshold value (0-255) that sets pixel on or off, default 128')
+
+    parser.add_argument(
+            '-c', '--clip',
+            metavar='PATH',
+            action='append',
+            default=[],
+            help='Video clip to measure the bytes sent to the device with, can be given multiple times. '
+                 'Up to --frames frames are read from each clip')
+
+    return parser.parse_args()
+
+
+def legacy_pack_frame(image, data):
+    """
+    Original XBM string based frame conversion, kept as reference.
+
+    Parameters:
+    image (PIL.Image.Image): Source image to convert
+    data (dict): Script-internal meta data
+
+    Returns:
+    bytes: raw frame data in the display's memory layout
+    """
+    small = image.resize((data['res_x'], data['res_y']))
+    rotflip = small.transpose(Image.ROTATE_270).transpose(Image.FLIP_LEFT_RIGHT)
+    bw = rotflip.convert('L').point(lambda x: 0 if x > data['args'].threshold else 255, '1')
+
+    xbm_string = bw.tobitmap().decode('ASCII')
+    data_start = xbm_string.find('{') + 1
+    data_end = xbm_string.find('}')
+    raw_xbm = xbm_string[data_start:data_end].replace('\n', '')
+
+    arr = [int(n, base=16) for n in raw_xbm.split(',')]
+    nparr = np.asarray(arr)
+    matrix = np.asmatrix(np.split(nparr, data['res_x'])).transpose()
+
+    return matrix.astype('uint8').tobytes('C')
+
+
+def generate_frames(args):
+    """
+    Generate a set of RGB source frames with both noise and smooth gradients,
+    so all threshold outcomes are covered.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+
+    Returns:
+    list: PIL.Image.Image source frames
+    """
+    rng = np.random.default_rng(0x4d6f6921)
+    frames = []
+    for i in range(min(args.frames, 16)):
+        noise = rng.integers(0, 256, (args.height, args.width, 3), dtype=np.uint8)
+        gradient = np.linspace(0, 255, args.width, dtype=np.uint8)
+        noise[:args.height // 2] = np.roll(gradient, i * 8)[np.newaxis, :, np.newaxis]
+        frames.append(Image.fromarray(noise))
+
+    return frames
+
+
+def run(name, function, frames, data, count):
+    """
+    Run a single benchmark and print its throughput.
+
+    Parameters:
+    name (str): Benchmark name to print
+    function (callable): Conversion function taking a frame and the given data
+    frames (list): Source frames, cycled through until count is reached
+    data: Additional data passed on to the conversion function
+    count (int): Number of frames to convert
+
+    Returns:
+    float: frames per second
+    """
+    start = time.perf_counter()
+    for i in range(count):
+        function(frames[i % len(frames)], data)
+    elapsed = time.perf_counter() - start
+
+    fps = count / elapsed
+    print('  {:<24} {:9.1f} frames/s  {:8.3f} ms/frame'.format(name, fps, elapsed * 1000 / count))
+    return fps
+
+
+class WireCounter:
+    """
+    Stand-in for the USB device that only counts what would be sent to it.
+    Display data carried in the setup packet itself counts as sent bytes, too.
+    """
+    SETUP_DATA = {usbxbm.CMD_POKE: 2, usbxbm.CMD_POKE_NEXT: 4}
+
+    def __init__(self):
+        self.transfers = 0
+        self.bytes = 0
+
+    def ctrl_transfer(self, request_type, request, value, index, payload=b''):
+        self.transfers += 1
+        self.bytes += len(payload) + self.SETUP_DATA.get(request, 0)
+
+
+def load_clip(path, count):
+    """
+    Read frames from a video clip.
+
+    Parameters:
+    path (str): Video clip path
+    count (int): Maximum number of frames to read
+
+    Returns:
+    list: BGR frames as numpy.ndarray
+    """
+    cap = cv2.VideoCapture(path)
+    frames = []
+    while len(frames) < count:
+        ret, frame = cap.read()
+        if not ret:
+            break
+        frames.append(frame)
+    cap.release()
+
+    return frames
+
+
+def scrolling_frames(res_x, res_y, count):
+    """
+    Generate display-sized BGR frames of a block pattern scrolling up by two
+    rows per frame, like a log or end credits would.
+
+    Parameters:
+    res_x (int): Display width
+    res_y (int): Display height
+    count (int): Number of frames
+
+    Returns:
+    list: BGR frames as numpy.ndarray
+    """
+    rng = np.random.default_rng(0x4d6f6921)
+    blocks = rng.integers(0, 2, ((res_y + 2 * count) // 4 + 1, res_x // 4 + 1), dtype=np.uint8) * 255
+    pattern = np.kron(blocks, np.ones((4, 4), dtype=np.uint8))[:, :res_x]
+
+    return [cv2.cvtColor(pattern[i * 2:i * 2 + res_y], cv2.COLOR_GRAY2BGR) for i in range(count)]
+
+
+def starfield_frames(res_x, res_y, count):
+    """
+    Generate display-sized BGR frames of a few single pixel stars moving left
+    at different speeds, i.e. only a few scattered pixels change per frame.
+
+    Parameters:
+    res_x (int): Display width
+    res_y (int): Display height
+    count (int): Number of frames
+
+    Returns:
+    list: BGR frames as numpy.ndarray
+    """
+    rng = np.random.default_rng(0x4d6f6921)
+    stars = 24
+    x = rng.integers(0, res_x, stars)
+    y = rng.integers(0, res_y, stars)
+    speed = rng.integers(1, 4, stars)
+
+    frames = []
+    for i in range(count):
+        gray = np.full((res_y, res_x), 255, dtype=np.uint8)
+        gray[y, (x - i * speed) % res_x] = 0
+        frames.append(cv2.cvtColor(gray, cv2.COLOR_GRAY2BGR))
+
+    return frames
+
+
+def benchmark_wire(args, frames):
+    """
+    Measure how many bytes are sent to the device for the generated frames,
+    generated scrolling and starfield frames, and each --clip video: as plain full frames,
+    as full frames encoded where it helps, and as encoded changed windows.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    frames (list): Source frames
+    """
+    sources = [('generated', [np.asarray(frame)[:, :, ::-1].copy() for frame in frames])]
+    for path in args.clip:
+        sources.append((path, load_clip(path, args.frames)))
+
+    for display, (res_x, res_y) in DISPLAYS.items():
+        data = {'res_x': res_x, 'res_y': res_y, 'args': args}
+        # Same as the device reports it, the SSD1306 can scroll with 64 rows
+        features = usbxbm.DISPLAY_FEATURE_START_LINE if display == 'ssd1306' and res_y == 64 else 0
+
+        count = min(args.frames, 200)
+        generated = [('scrolling', scrolling_frames(res_x, res_y, count)),
+                     ('starfield', starfield_frames(res_x, res_y, count))]
+        for name, clip in sources + generated:
+            packed = [usbxbm.pack_video_frame(frame, data) for frame in clip]
+            if not packed:
+                print('{} {}x{} {}: no frames'.format(display, res_x, res_y, name))
+                continue
+
+            raw = len(packed) * len(packed[0])
+            print('{} {}x{} {} ({} frames):'.format(display, res_x, res_y, name, len(packed)))
+            print('  {:<24} {:9d} bytes'.format('raw full frames', raw))
+
+            for label, full in (('encoded full frames', True), ('encoded changed windows', False)):
+                counter = WireCounter()
+                send_args = argparse.Namespace(**dict(vars(args), full=full, delay=0,
+                        min_change=0, keepalive=0, interlace=1))
+                send_data = {'res_x': res_x, 'res_y': res_y, 'args': send_args, 'dev': counter,
+                             'features': features}
+                for frame_data in packed:
+                    usbxbm.send_frame(frame_data, send_data)
+
+                print('  {:<24} {:9d} bytes  {:6.1f}% of raw  {:5d} transfers'.format(
+                        label, counter.bytes, counter.bytes * 100 / raw, counter.transfers))
+
+    print('')
+
+
+def benchmark_packing(args, frames):
+    """
+    Compare the original XBM string based conversion with pack_frame() using
+    the numpy packer and, if it's built, the native xbmpack extension, all on
+    the same frames, making sure they all produce the exact same output.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    frames (list): Source frames
+
+    Returns:
+    bool: True if all outputs were identical
+    """
+    identical = True
+    native = usbxbm.xbmpack
+
+    def numpy_pack_frame(frame, data):
+        # pack_frame() picks xbmpack on its own if it's there, hide it for the numpy run
+        usbxbm.xbmpack = None
+        try:
+            return usbxbm.pack_frame(frame, data)
+        finally:
+            usbxbm.xbmpack = native
+
+    for display, (res_x, res_y) in DISPLAYS.items():
+        data = {'res_x': res_x, 'res_y': res_y, 'args': args}
+
+        same = all(legacy_pack_frame(frame, data) == numpy_pack_frame(frame, data) == usbxbm.pack_frame(frame, data)
+                   for frame in frames)
+        identical = identical and same
+
+        print('{} {}x{} ({}):'.format(display, res_x, res_y, 'identical' if same else 'MISMATCH'))
+        before = run('tobitmap() round-trip', legacy_pack_frame, frames, data, args.frames)
+        after = run('pack_frame() numpy', numpy_pack_frame, frames, data, args.frames)
+        print('  speedup {:.1f}x'.format(after / before))
+        if native is not None:
+            after = run('pack_frame() xbmpack ' + native.kernel, usbxbm.pack_frame, frames, data, args.frames)
+            print('  speedup {:.1f}x'.format(after / before))
+        else:
+            print('  xbmpack extension not built, no native figure')
+
+    return identical
+
+
+def benchmark_jpeg(args, frames):
+    """
+    Compare fully decoding JPEG images with decoding them in draft mode,
+    as done in --image and --imgseries mode.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    frames (list): Source frames
+    """
+    jpegs = []
+    for frame in frames:
+        buffer = io.BytesIO()
+        frame.save(buffer, 'JPEG', quality=90)
+        jpegs.append(buffer.getvalue())
+
+    full = lambda jpeg, data: usbxbm.pack_frame(Image.open(io.BytesIO(jpeg)), data)
+    draft = lambda jpeg, data: usbxbm.pack_frame(usbxbm.open_image(io.BytesIO(jpeg), data), data)
+
+    for display, (res_x, res_y) in DISPLAYS.items():
+        data = {'res_x': res_x, 'res_y': res_y, 'args': args}
+
+        print('{} {}x{} from {}x{} JPEG images:'.format(display, res_x, res_y, args.width, args.height))
+        before = run('full decode', full, jpegs, data, args.frames)
+        after = run('open_image() draft mode', draft, jpegs, data, args.frames)
+        print('  speedup {:.1f}x'.format(after / before))
+
+    print('')
+
+
+def benchmark_gray_packing(args, frames):
+    """
+    Compare the numpy packer with the native xbmpack extension on frames that
+    are already display-sized grayscale, i.e. the packing step on its own.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    frames (list): Source frames
+
+    Returns:
+    bool: True if all outputs were identical
+    """
+    if usbxbm.xbmpack is None:
+        print('xbmpack extension not built, skipping native packing benchmark\n')
+        return True
+
+    identical = True
+
+    for display, (res_x, res_y) in DISPLAYS.items():
+        grays = [np.asarray(frame.resize((res_x, res_y)).convert('L')) for frame in frames]
+        native = lambda gray, threshold: usbxbm.xbmpack.pack(gray, res_x, res_y, threshold)
+
+        same = all(usbxbm.pack_gray_numpy(gray, args.threshold) == native(gray, args.threshold) for gray in grays)
+        identical = identical and same
+
+        print('{} {}x{} grayscale ({}):'.format(display, res_x, res_y, 'identical' if same else 'MISMATCH'))
+        before = run('pack_gray_numpy()', usbxbm.pack_gray_numpy, grays, args.threshold, args.frames)
+        after = run('xbmpack.pack() ' + usbxbm.xbmpack.kernel, native, grays, args.threshold, args.frames)
+        print('  speedup {:.1f}x'.format(after / before))
+
+    print('')
+    return identical
+
+
+def benchmark_video(args, frames):
+    """
+    Compare handling OpenCV video frames by wrapping them in PIL images with
+    converting them straight within numpy / OpenCV.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    frames (list): Source frames
+    """
+    bgr_frames = [np.asarray(frame)[:, :, ::-1].copy() for frame in frames]
+    from_pil = lambda frame, data: usbxbm.pack_frame(Image.fromarray(frame), data)
+
+    for display, (res_x, res_y) in DISPLAYS.items():
+        data = {'res_x': res_x, 'res_y': res_y, 'args': args}
+
+        print('{} {}x{} from {}x{} BGR video frames:'.format(display, res_x, res_y, args.width, args.height))
+        before = run('PIL pack_frame()', from_pil, bgr_frames, data, args.frames)
+        after = run('pack_video_frame()', usbxbm.pack_video_frame, bgr_frames, data, args.frames)
+        print('  speedup {:.1f}x'.format(after / before))
+
+    print('')
+
+
+def main():
+    args = parse_args()
+
+    frames = generate_frames(args)
+    print('{} source frames of {}x{}\n'.format(len(frames), args.width, args.height))
+
+    benchmark_wire(args, frames)
+    benchmark_video(args, frames)
+    benchmark_jpeg(args, frames)
+    identical = benchmark_gray_packing(args, frames)
+    identical = benchmark_packing(args, frames) and identical
+
+    if not identical:
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
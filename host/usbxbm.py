@@ -26,13 +26,38 @@
 import os
 import sys
 import cv2
+import copy
 import glob
 import time
+import queue
+import signal
+import shutil
 import struct
+import itertools
+import threading
+import subprocess
 import argparse
+import collections
+import multiprocessing
+import concurrent.futures
 import usb.core
 import numpy as np
-from PIL import Image
+from PIL import Image, ImageSequence
+
+import xbmv
+
+# Shared memory for the --pipeline option requires Python 3.8 or newer
+try:
+    from multiprocessing import shared_memory
+except ImportError:
+    shared_memory = None
+
+# Optional native frame packing extension, see setup.py for building it.
+# If it's not built, frames are packed with numpy instead.
+try:
+    import xbmpack
+except ImportError:
+    xbmpack = None
 
 # Expected USB device information
 USB_VID = 0x1209
@@ -48,14 +73,130 @@ USB_RECV = 0xC0
 CMD_HELLO = 0x55
 CMD_PROPS = 0x10
 CMD_DATA  = 0x20
+CMD_WINDOW = 0x21
+CMD_DATA_RLE = 0x22
+CMD_DATA_TILE = 0x23
+CMD_PAGES = 0x24
+CMD_PIXELS = 0x25
+CMD_POKE = 0x26
+CMD_POKE_NEXT = 0x27
+CMD_BATCH = 0x28
+CMD_SCROLL = 0x30
+CMD_TEXT = 0x31
+CMD_FILL = 0x32
+CMD_INVERT = 0x33
+CMD_CLEAR = 0x34
+CMD_ASSET = 0x40
+CMD_ANIMATE = 0x41
+CMD_SPRITE_SET = 0x42
+CMD_SPRITE_MOVE = 0x43
+CMD_SPRITE_HIDE = 0x44
 CMD_RESET = 0xf0
 CMD_BYE   = 0xaa
 
+# Common camera capture resolutions, from small to large, to try when looking
+# for the smallest one that still covers the display's resolution
+CAMERA_RESOLUTIONS = [(160, 120), (176, 144), (320, 240), (352, 288), (640, 360), (640, 480), (1280, 720)]
+
+# Estimated cost of a single CMD_WINDOW transfer on top of its payload, in
+# bytes: the USB control request's setup and the device readdressing the
+# display. Used to decide whether changed areas are sent separately or merged.
+WINDOW_OVERHEAD = 32
+
+# Widest single page window that is sent as setup-only CMD_POKE requests, i.e.
+# a CMD_POKE request with 2 bytes and one CMD_POKE_NEXT request with 4 more.
+# Every further CMD_POKE_NEXT request would cost about as much as a CMD_WINDOW.
+POKE_COLUMNS = 6
+
+# CMD_BATCH sub-commands
+BATCH_WINDOW = 0x01
+BATCH_DATA = 0x02
+BATCH_DATA_RLE = 0x03
+BATCH_DATA_TILE = 0x04
+BATCH_FILL = 0x05
+BATCH_COMMAND = 0x06
+BATCH_SCROLL = 0x07
+
+# Size of the device's asset pool for CMD_ASSET uploads, in bytes
+ASSET_SIZE = 256
+
+# Number of sprites the device can have defined at once
+SPRITE_COUNT = 8
+
+# Display feature flags as reported by CMD_PROPS
+DISPLAY_FEATURE_START_LINE = 0x01
+
 # parameters for CMD_HELLO (it's just ASCII for the Finnish greeting "Moi!")
 HELLO_VALUE = 0x4d6f
 HELLO_INDEX = 0x6921
 
 
+def parse_pipeline_depths(value):
+    """
+    Parse the --pipeline command line parameter value.
+
+    Parameters:
+    value (str): Either a single depth used for both ring buffers, or two comma separated ones
+
+    Returns:
+    tuple: (decode depth, convert depth)
+    """
+    try:
+        depths = tuple(int(depth) for depth in value.split(','))
+    except ValueError:
+        raise argparse.ArgumentTypeError('invalid depth "{}"'.format(value))
+
+    if len(depths) == 1:
+        depths = depths * 2
+
+    if len(depths) != 2 or min(depths) < 1:
+        raise argparse.ArgumentTypeError('expected one or two depths of at least 1, got "{}"'.format(value))
+
+    return depths
+
+
+def parse_geometry(value):
+    """
+    Parse the --geometry command line parameter value.
+
+    Parameters:
+    value (str): Display resolution as WIDTHxHEIGHT
+
+    Returns:
+    tuple: (width, height)
+    """
+    try:
+        res_x, res_y = (int(n) for n in value.lower().split('x'))
+    except ValueError:
+        raise argparse.ArgumentTypeError('invalid geometry "{}"'.format(value))
+
+    if res_x < 1 or res_y < 8 or res_y % 8 != 0:
+        raise argparse.ArgumentTypeError('height must be a positive multiple of 8, got "{}"'.format(value))
+
+    return res_x, res_y
+
+
+def parse_position(value):
+    """
+    Parse the --position command line parameter value.
+
+    Parameters:
+    value (str): Column and page, separated by a comma, e.g. "0,5"
+
+    Returns:
+    tuple: (column, page)
+    """
+    try:
+        column, page = (int(number) for number in value.split(','))
+    except ValueError:
+        raise argparse.ArgumentTypeError('invalid position "{}", expected COLUMN,PAGE'.format(value))
+
+    if column < 0 or page < 0:
+        raise argparse.ArgumentTypeError('invalid position "{}", must not be negative'.format(value))
+
+    return (column, page)
+
+
 def parse_args():
     """
     Parse all command line parameters
@@ -65,7 +206,7 @@ def parse_args():
     """
     parser = argparse.ArgumentParser(
             description='usbxbm host-side control application',
-            epilog='Either one of --camera, --image, --imgseries, or --video must be given')
+            epilog='Either one of --camera, --image, --imgseries, --video, --xbmv, --text, or --animation must be given')
 
 
     modes = parser.add_mutually_exclusive_group(required=True)
@@ -93,12 +234,47 @@ def parse_args():
             metavar='PATH',
             help='Send a whole video located in PATH to USB device')
 
+    modes.add_argument(
+            '-x', '--xbmv',
+            metavar='PATH',
+            help='Send all frames of an .xbmv file located in PATH, as recorded with --record, to USB device')
+
+    modes.add_argument(
+            '-T', '--text',
+            metavar='TEXT',
+            help='Render TEXT on the device with its built-in font, each line on its own page')
+
+    modes.add_argument(
+            '-A', '--animation',
+            metavar='PATH',
+            help='Upload the animated image located in PATH to the USB device, which then keeps playing it on its own')
+
     modes.add_argument(
             '-r', '--reset',
             action='store_true',
             help='Simple resets the device to its initial state (i.e. showing splash screen')
 
 
+    parser.add_argument(
+            '-P', '--position',
+            metavar='COLUMN,PAGE',
+            type=parse_position,
+            default=(0, 0),
+            help='Column and page (i.e. row of 8 pixels) where the text or animation starts, default 0,0. '
+                 'Only relevant for --text and --animation mode, ignored otherwise')
+
+    parser.add_argument(
+            '--clear',
+            action='store_true',
+            help='Clear the display before rendering the text. Only relevant for --text mode, ignored otherwise')
+
+    parser.add_argument(
+            '--contrast',
+            metavar='[0-255]',
+            type=int,
+            choices=range(256),
+            help='Set the display contrast before anything else')
+
     parser.add_argument(
             '-t', '--threshold',
             metavar='[0-255]',
@@ -113,10 +289,117 @@ def parse_args():
             default=0,
             help='Add optional delay between frames, given in seconds as float number, so 0.2 is 200ms')
 
+    parser.add_argument(
+            '-b', '--backend',
+            choices=['opencv', 'ffmpeg'],
+            default='opencv',
+            help='Video decoding backend for --video mode, falls back to opencv if ffmpeg is not found, default opencv')
+
+    parser.add_argument(
+            '--no-mailbox',
+            dest='mailbox',
+            action='store_false',
+            help='Read camera frames in sequence instead of always taking the most recent one. '
+                 'Only relevant for --camera mode, ignored otherwise')
+
+    parser.add_argument(
+            '-R', '--realtime',
+            action='store_true',
+            help='Play video at its own frame rate, skipping frames when falling behind. '
+                 'Only relevant for --video mode without --pipeline and --xbmv mode, ignored otherwise')
+
+    parser.add_argument(
+            '-p', '--pipeline',
+            metavar='DEPTH[,DEPTH]',
+            type=parse_pipeline_depths,
+            nargs='?',
+            const=(4, 4),
+            help='Decode, convert, and send frames in separate processes, with the given number of frame slots '
+                 'between decoding and converting, and converting and sending, default 4,4. '
+                 'Only relevant for --camera and --video mode, ignored otherwise')
+
     parser.add_argument(
             '-l', '--loop',
             action='store_true',
-            help='Loop a playback forever. Only relevant for --video and --imgseries mode, ignored otherwise')
+            help='Loop a playback forever. Only relevant for --video, --imgseries, and --xbmv mode, ignored otherwise')
+
+    parser.add_argument(
+            '-C', '--cache',
+            metavar='MIB',
+            type=int,
+            default=64,
+            help='Memory budget in MiB for caching converted frames when looping, 0 disables it, default 64. '
+                 'Only relevant for --video and --imgseries mode with --loop, ignored otherwise')
+
+    parser.add_argument(
+            '-o', '--record',
+            metavar='PATH',
+            help='Record all converted frames into an .xbmv file at PATH instead of sending them to USB device. '
+                 'Only relevant for --camera, --imgseries, and --video mode, ignored otherwise')
+
+    parser.add_argument(
+            '-g', '--geometry',
+            metavar='WIDTHxHEIGHT',
+            type=parse_geometry,
+            help='Display resolution to record for, e.g. 84x48 or 128x64. '
+                 'If not given, it is retrieved from the USB device. Only relevant for --record')
+
+    parser.add_argument(
+            '-j', '--jobs',
+            metavar='COUNT',
+            type=int,
+            default=0,
+            help='Number of processes converting frames in parallel, 1 converts them one by one, '
+                 'default 0 uses all CPU cores. '
+                 'Only relevant for --imgseries mode, and --video mode with --record, ignored otherwise')
+
+    parser.add_argument(
+            '--full',
+            action='store_true',
+            help='Always send complete frames instead of only the areas that changed since the previous frame')
+
+    parser.add_argument(
+            '--diff',
+            action='store_true',
+            help='Send only the areas that changed since the previous frame, like all other modes do, '
+                 'instead of each recorded frame as-is. Only relevant for --xbmv mode, ignored otherwise')
+
+    parser.add_argument(
+            '-I', '--interlace',
+            metavar='FIELDS',
+            type=int,
+            nargs='?',
+            const=2,
+            default=1,
+            help='Only send every FIELDS-th page of each frame, moving on to the next set of pages with every frame, '
+                 'default 2 if given without value. Trades vertical resolution of motion for frame rate')
+
+    parser.add_argument(
+            '-m', '--min-change',
+            metavar='PIXELS',
+            type=int,
+            default=0,
+            help='Skip frames that differ from the one on the display by fewer than PIXELS pixels, '
+                 'default 0 only skips identical frames. Ignored with --full')
+
+    parser.add_argument(
+            '-k', '--keepalive',
+            metavar='SECONDS',
+            type=float,
+            default=2,
+            help='Send a complete frame after skipping frames for this long, 0 disables it, default 2. '
+                 'Ignored with --full')
+
+    parser.add_argument(
+            '-B', '--band',
+            metavar='PAGES',
+            type=int,
+            nargs='?',
+            const=1,
+            default=0,
+            help='Convert and send each frame in bands of PAGES pages, default 1 if given without value, '
+                 'sending each band while converting the next one. Only relevant for --camera and --video mode, '
+                 'ignored otherwise')
 
     return parser.parse_args()
 
@@ -175,12 +458,12 @@ def get_usb_device_properties(dev):
     properties = dev.ctrl_transfer(USB_RECV, CMD_PROPS, 0, 0, 128)
 
     # Unpack raw data into a struct to extract the individual property values
-    properties_struct_string = "= H H B 20s"
-    (res_x, res_y, color_bits, identifier) = struct.unpack(properties_struct_string, properties)
+    properties_struct_string = "= H H B 20s B"
+    (res_x, res_y, color_bits, identifier, features) = struct.unpack(properties_struct_string, properties)
     print('-> [PROPS] {}: {}x{}@{}'.format(identifier.decode('UTF-8'), res_x, res_y, color_bits))
 
     # return the properties as dictionary
-    return {'res_x': res_x, 'res_y': res_y, 'color_bits': color_bits, 'display': identifier}
+    return {'res_x': res_x, 'res_y': res_y, 'color_bits': color_bits, 'display': identifier, 'features': features}
 
 
 def close_usb_device(dev):
@@ -199,260 +482,2574 @@ def close_usb_device(dev):
     dev.ctrl_transfer(USB_SEND, CMD_BYE, 0, 0)
 
 
-def send_image(image, data):
+def pack_gray_numpy(gray, threshold):
     """
-    Send a given image to the connected usbxbm device.
+    Pack a display-sized grayscale frame into raw display data using numpy.
+
+    Both displays organize their memory in pages of 8 vertically stacked pixels,
+    with the top-most pixel of each page in the byte's LSB, and the pages being
+    sent from top to bottom, each one column by column from left to right.
+    Grouping the frame's rows by 8 and packing each group column-wise therefore
+    results straight in the layout the display expects, without any need for
+    rotating or flipping the image first.
 
     Parameters:
-    image (PIL.Image.Image): Source image to convert and send via USB
-    data (dict): Script-internal meta data
-    """
-    # Resize the given image to the display's resolution
-    small = image.resize((data['res_x'], data['res_y']))
+    gray (numpy.ndarray): 8-bit grayscale frame of shape (res_y, res_x)
+    threshold (int): color threshold value, pixels up to this value are set
 
-    # Rotate and flip the image to match the LCD/OLED arrangements
-    rotflip = small.transpose(Image.ROTATE_270).transpose(Image.FLIP_LEFT_RIGHT)
+    Returns:
+    bytes: raw frame data in the display's memory layout
+    """
+    # Pixels not brighter than the threshold are set (i.e. black on the display)
+    bits = gray <= threshold
 
-    # Turn image into 8-bit black and white based on the threshold value given as command line parameter
-    bw = rotflip.convert('L').point(lambda x: 0 if x > data['args'].threshold else 255, '1')
+    # Split the rows into pages of 8 and pack each page's columns into bytes, LSB first
+    pages = bits.reshape(-1, 8, gray.shape[1])
+    return np.packbits(pages, axis=1, bitorder='little').tobytes()
 
-    # Turn that black-and-white image into XBM image string..
-    xbm_string = bw.tobitmap().decode('ASCII')
-    # ..and extract raw XBM values from the parts within curly braces (also removing line breaks)
-    data_start = xbm_string.find('{') + 1
-    data_end = xbm_string.find('}')
-    raw_xbm = xbm_string[data_start:data_end].replace('\n', '')
 
-    # Turn raw XBM data into an array of hex numbers..
-    arr = [int(n, base=16) for n in raw_xbm.split(',')]
-    # ..and create a numpy array from it
-    nparr = np.asarray(arr)
+def pack_gray(gray, threshold):
+    """
+    Pack a display-sized grayscale frame into raw display data.
 
-    # Split the array based on the display width, turn it into a matrix, and transpose it
-    matrix = np.asmatrix(np.split(nparr, data['res_x'])).transpose()
+    Uses the native xbmpack extension if it's built, and falls back to
+    pack_gray_numpy() otherwise. Both produce the exact same output.
 
-    # Finally, turn the matrix into a series of bytes..
-    frame_data = matrix.astype('uint8').tobytes('C')
-    # ..and send it as-is to the device
-    data['dev'].ctrl_transfer(USB_SEND, CMD_DATA, 0, 0, frame_data)
+    Parameters:
+    gray (numpy.ndarray): 8-bit grayscale frame of shape (res_y, res_x)
+    threshold (int): color threshold value, pixels up to this value are set
 
-    # If a --delay command line parameter was set, delay accordingly
-    if data['args'].delay > 0:
-        time.sleep(data['args'].delay)
+    Returns:
+    bytes: raw frame data in the display's memory layout
+    """
+    if xbmpack is not None:
+        gray = np.ascontiguousarray(gray, dtype=np.uint8)
+        return xbmpack.pack(gray, gray.shape[1], gray.shape[0], threshold)
 
+    return pack_gray_numpy(gray, threshold)
 
 
-def init_camera(args):
+def pack_frame(image, data):
     """
-    Initialization callback for camera mode.
-
-    Creates OpenCV video capture object from the given args information (camera source id)
-    that was passed from the command line parameters and returns it in a dictionary.
+    Convert a given image into raw display data for the connected usbxbm device.
 
     Parameters:
-    args (argparse.Namespace): Parsed command line argument object
+    image (PIL.Image.Image): Source image to convert
+    data (dict): Script-internal meta data
 
     Returns:
-    dict: Dictionary containing a cv2.VideoCapture object
+    bytes: raw frame data in the display's memory layout
     """
-    cap = cv2.VideoCapture(args.camera)
-    return {'cap': cap}
+    # Resize the given image to the display's resolution and turn it into 8-bit grayscale
+    gray = image.resize((data['res_x'], data['res_y'])).convert('L')
+
+    return pack_gray(np.asarray(gray), data['args'].threshold)
 
 
-def init_video(args):
+def pack_video_frame(frame, data):
     """
-    Initialization callback for video mode.
+    Convert a given OpenCV video frame into raw display data for the connected usbxbm device.
 
-    Creates OpenCV video capture object from the given args information (video file)
-    that was passed from the command line parameters and returns it in a dictionary.
+    Unlike pack_frame(), this stays within numpy / OpenCV and scales the frame
+    down to the display's resolution first, so the color conversion only needs
+    to handle the display-sized image instead of the full-resolution frame.
 
     Parameters:
-    args (argparse.Namespace): Parsed command line argument object
+    frame (numpy.ndarray): BGR, BGRA, or grayscale frame as returned by OpenCV or FfmpegCapture
+    data (dict): Script-internal meta data
 
     Returns:
-    dict: Dictionary containing a cv2.VideoCapture object
+    bytes: raw frame data in the display's memory layout
     """
-    cap = cv2.VideoCapture(args.video)
-    return {'cap': cap}
+    # Resize the frame to the display's resolution, INTER_AREA is both the fastest
+    # and best looking option when shrinking a frame by this much.
+    # Frames from the ffmpeg backend are already scaled, so leave those as they are.
+    small = frame
+    if frame.shape[:2] != (data['res_y'], data['res_x']):
+        small = cv2.resize(frame, (data['res_x'], data['res_y']), interpolation=cv2.INTER_AREA)
 
+    # Turn the small frame into 8-bit grayscale, unless the source already was
+    if small.ndim == 3:
+        code = cv2.COLOR_BGRA2GRAY if small.shape[2] == 4 else cv2.COLOR_BGR2GRAY
+        small = cv2.cvtColor(small, code)
 
-def process_video(data):
-    """
-    Frame-processing callback for video capture modes (camera and video)
+    return pack_gray(small, data['args'].threshold)
 
-    Retrieves frames from the video capture object referenced in the given meta data
-    dictionary and sends them to the device. If retrieving a frame fails in video mode,
-    it's assumed that the video itself was finished sending, and the loop either starts
-    over (if the --loop command line parameter was given), or stops and returns.
+
+def pack_video_band(frame, first_row, rows, data):
+    """
+    Convert a horizontal band of a given OpenCV video frame into raw display
+    data, the same way pack_video_frame() converts the whole frame.
 
     Parameters:
+    frame (numpy.ndarray): BGR, BGRA, or grayscale frame as returned by OpenCV or FfmpegCapture
+    first_row (int): First display row of the band, multiple of 8
+    rows (int): Number of display rows in the band, multiple of 8
     data (dict): Script-internal meta data
-    """
-    while True:
-        # Get the next frame from the video source
-        ret, frame = data['cap'].read()
 
-        if not ret:
-            # No frame retrieved.
-            # If source is a video file, end of file was presumably reached.
-            # Check if --loop parameter was given and rewind back to the first frame
-            if data['args'].video is not None and data['args'].loop:
-                data['cap'].set(cv2.CAP_PROP_POS_FRAMES, 0)
-                continue
+    Returns:
+    bytes: raw band data in the display's memory layout
+    """
+    # Take the frame rows that end up in the band's display rows
+    height = frame.shape[0]
+    band = frame[first_row * height // data['res_y']:(first_row + rows) * height // data['res_y']]
+    if band.shape[:2] != (rows, data['res_x']):
+        band = cv2.resize(band, (data['res_x'], rows), interpolation=cv2.INTER_AREA)
 
-            # Either not a video or no --loop option given, we're done then
-            break
+    if band.ndim == 3:
+        code = cv2.COLOR_BGRA2GRAY if band.shape[2] == 4 else cv2.COLOR_BGR2GRAY
+        band = cv2.cvtColor(band, code)
 
-        # Create an image from the video frame and send it
-        image = Image.fromarray(frame)
-        send_image(image, data)
+    return pack_gray(band, data['args'].threshold)
 
 
-def process_single_image(data):
+def open_image(path, data):
     """
-    Frame-processing callback for single image mode.
+    Open a given image file for sending it to the connected usbxbm device.
 
-    Opens the image file defined in the parsed command line parameters (stored within
-    the given meta data dictionary) and sends it to the device.
+    JPEG images are set to draft mode, so they're decoded straight in grayscale
+    and scaled down by the largest of 1/2, 1/4, or 1/8 that still keeps them at
+    least as large as the display's resolution. That way, large photos never get
+    fully decoded just to be shrunk down right after. Other formats are opened
+    as-is, draft mode has no effect on them.
 
     Parameters:
+    path (str): Path to the image file, or a file object
     data (dict): Script-internal meta data
+
+    Returns:
+    PIL.Image.Image: the opened image
     """
-    image = Image.open(data['args'].image)
-    send_image(image, data)
+    image = Image.open(path)
+    image.draft('L', (data['res_x'], data['res_y']))
+    return image
 
 
-def process_image_series(data):
+def rle_encode(raw):
     """
-    Frame-processing callback for image series mode.
+    Run-length encode display data in PackBits format, as decoded by the
+    device's CMD_DATA_RLE request.
 
-    Loops through the directory defined in the parsed command line parameters (stored within
-    the given meta data dictionary), opens each *.jpg file (currently only considers JPG files
-    but could be adjusted if e.g. PNG is also needed) ands ends it to the device either until
-    every single picture in the directory is sent, or (depending on another parameter) for all
-    eternity (or until CTRL+C is hit).
+    Runs of at least 3 identical bytes become a repeat packet, i.e. header byte
+    257 - length followed by the repeated byte, everything else gets collected
+    in literal packets, i.e. header byte length - 1 followed by the bytes as-is.
+    Both packet types hold up to 128 bytes.
 
-    The files are processed in alphabetical order, and an image series itself could be easily
-    generated with ffmpeg using printf-style formatting as output name:
-        ffmpeg -i /path/to/video xxx_%05d.jpg
-    or with some optional cropping or scaling:
-        ffmpeg -i /path/to/video -vf crop:460:360,scale=128:64 xxx_%05d.jpg
+    Parameters:
+    raw (bytes): Raw display data
 
-    Note that unlike the video mode, the video frame rate is ignored in the image series mode
-    and pre-scaling the image could slightly speed up the processing time, and by that the
-    frame rate itself - although the OLED is mostly limited to the i2c clock speed and won't
-    benefit much here. The SPI-connected Nokia LCD on the other hand could gain a frame or
-    two by pre-scaling the image.
+    Returns:
+    bytes: Encoded display data
+    """
+    encoded = bytearray()
+    literal = bytearray()
+
+    def flush_literal():
+        for start in range(0, len(literal), 128):
+            chunk = literal[start:start + 128]
+            encoded.append(len(chunk) - 1)
+            encoded.extend(chunk)
+        del literal[:]
+
+    for value, group in itertools.groupby(raw):
+        length = sum(1 for _ in group)
+        if length < 3:
+            literal.extend(bytes((value,)) * length)
+            continue
+
+        flush_literal()
+        while length > 1:
+            run = min(length, 128)
+            encoded.append(257 - run)
+            encoded.append(value)
+            length -= run
+        if length == 1:
+            literal.append(value)
+
+    flush_literal()
+    return bytes(encoded)
+
+
+class Batch:
+    """
+    Builder for a CMD_BATCH sub-command stream, so that several requests,
+    e.g. all windows of one frame, are sent to the device in one single
+    transfer, paying the USB control transfer's setup and status overhead
+    only once.
+    """
+
+    # Sub-command for each way data is encoded, as returned by encode_window()
+    DATA_COMMANDS = {CMD_WINDOW: BATCH_DATA, CMD_DATA_RLE: BATCH_DATA_RLE, CMD_DATA_TILE: BATCH_DATA_TILE}
+
+    def __init__(self):
+        self.stream = bytearray()
+
+    def __len__(self):
+        return len(self.stream)
+
+    def window(self, first, last, page_first, page_last):
+        """
+        Set up a new window, ending the previous one.
+
+        Parameters:
+        first (int): First column of the window
+        last (int): Last column of the window
+        page_first (int): First page of the window
+        page_last (int): Last page of the window
+        """
+        self.stream += bytes([BATCH_WINDOW, first, last, page_first | (page_last << 4)])
+
+    def data(self, command, payload):
+        """
+        Write data to the current window, continuing where the previous data ended.
+
+        Parameters:
+        command (int): Request defining the encoding, as returned by encode_window()
+        payload (bytes): Data to write, encoded accordingly
+        """
+        self.stream += struct.pack('<BH', self.DATA_COMMANDS[command], len(payload)) + payload
+
+    def fill(self, pattern):
+        """
+        Fill the whole current window with a byte pattern, ending the window.
+
+        Parameters:
+        pattern (int): Byte to fill the window with
+        """
+        self.stream += bytes([BATCH_FILL, pattern])
+
+    def command(self, *commands):
+        """
+        Send command bytes straight to the display controller, ending the
+        current window.
+
+        Parameters:
+        commands (int): Command bytes, up to 255 of them
+        """
+        self.stream += bytes([BATCH_COMMAND, len(commands)] + list(commands))
+
+    def scroll(self, line):
+        """
+        Set the display start line like CMD_SCROLL, ending the current window.
+
+        Parameters:
+        line (int): Display RAM row to show in the display's top row
+        """
+        self.stream += bytes([BATCH_SCROLL, line])
+
+    def send(self, dev):
+        """
+        Send the sub-command stream to the device, if there is any.
+
+        Parameters:
+        dev (usb.core.Device): USB device object
+
+        Returns:
+        int: Number of bytes sent
+        """
+        if self.stream:
+            dev.ctrl_transfer(USB_SEND, CMD_BATCH, 0, 0, bytes(self.stream))
+        return len(self.stream)
+
+
+def contrast_commands(display, contrast):
+    """
+    Get the display controller commands to set a display's contrast.
 
     Parameters:
-    data (dict): Script-internal meta data
+    display (bytes): Display identifier, as reported by CMD_PROPS
+    contrast (int): Contrast, 0-255
+
+    Returns:
+    list: Command bytes, empty if the display is unknown
     """
-    keep_going = True
-    while keep_going:
-        for infile in sorted(glob.glob(data['args'].imgseries + "/*.jpg")):
-            image = Image.open(infile)
-            send_image(image, data)
+    if display.startswith(b'SSD1306'):
+        return [0x81, contrast]
 
-        if not data['args'].loop:
-            keep_going = False
+    if display.startswith(b'Nokia 5110'):
+        # Operating voltage is in the extended instruction set, and only has 7 bits
+        return [0x21, 0x80 | (contrast >> 1), 0x20]
 
+    return []
 
-def process_reset(data):
+
+class TileDictionary:
+    """
+    Host-side mirror of the device's tile dictionary for CMD_DATA_TILE requests.
+
+    Each page of a window is split into tiles of up to 8 columns, starting at
+    the window's first column. Tiles already in the dictionary are sent as a
+    single token byte holding the entry number and repeat count, new ones are
+    sent as literal tile and replace the least recently used entry. Which entry
+    gets replaced is decided here, the device simply stores the tile wherever
+    it's told to, so both sides stay in sync as long as every encoded window
+    is actually sent.
     """
-    Frame-processing callback for reset mode.
 
-    Doesn't really process anything, just sends a CMD_RESET request to the device.
+    # Number of dictionary entries, must match the device's TILE_ENTRIES
+    ENTRIES = 16
+
+    def __init__(self):
+        self.tiles = [None] * self.ENTRIES
+        self.used = [0] * self.ENTRIES
+        self.clock = 0
+
+    def encode(self, window, width):
+        """
+        Tile encode a window's data, updating the dictionary along the way.
+        To only try the encoding, encode with a copy of the dictionary.
+
+        Parameters:
+        window (bytes): Raw display data covering the window
+        width (int): Window width in columns
+
+        Returns:
+        bytes: Encoded display data
+        """
+        encoded = bytearray()
+        entries = {tile: entry for entry, tile in enumerate(self.tiles) if tile is not None}
+        run_entry = None
+        run_count = 0
+
+        for row in range(0, len(window), width):
+            for start in range(row, row + width, 8):
+                tile = bytes(window[start:min(start + 8, row + width)])
+                entry = entries.get(tile)
+                self.clock += 1
+
+                if entry is not None and entry == run_entry and run_count < 15:
+                    run_count += 1
+                else:
+                    if run_count > 0:
+                        encoded.append(((run_count - 1) << 4) | run_entry)
+                    run_entry = entry
+                    run_count = 0 if entry is None else 1
+
+                if entry is None:
+                    entry = self.used.index(min(self.used))
+                    if self.tiles[entry] is not None:
+                        del entries[self.tiles[entry]]
+                    self.tiles[entry] = tile
+                    entries[tile] = entry
+                    encoded.append(0xf0 | entry)
+                    encoded.extend(tile)
+
+                self.used[entry] = self.clock
+
+        if run_count > 0:
+            encoded.append(((run_count - 1) << 4) | run_entry)
+
+        return bytes(encoded)
+
+
+def encode_window(window, width, data):
+    """
+    Encode display data either run-length or tile encoded, or leave it as-is,
+    whichever is shortest.
 
     Parameters:
+    window (bytes): Raw display data covering a window
+    width (int): Window width in columns
     data (dict): Script-internal meta data
+
+    Returns:
+    tuple: (request defining the encoding, encoded data)
     """
-    print('-> [RESET]')
-    data['dev'].ctrl_transfer(USB_SEND, CMD_RESET, 0, 0)
+    dictionary = copy.deepcopy(data.setdefault('tiles', TileDictionary()))
+    candidates = [
+        (CMD_WINDOW, window),
+        (CMD_DATA_RLE, rle_encode(window)),
+        (CMD_DATA_TILE, dictionary.encode(window, width)),
+    ]
+    command, payload = min(candidates, key=lambda candidate: len(candidate[1]))
 
+    # The device only updates its dictionary with tile encoded data
+    if command == CMD_DATA_TILE:
+        data['tiles'] = dictionary
 
-def cleanup_video(data):
-    """
-    Cleanup callback for modes that handle OpenCV video (camera, video)
+    return command, payload
 
-    Releases the video capture object referenced in the given data parameter
+
+def send_window(window, first, last, page_first, page_last, data):
+    """
+    Send display data for a given window, encoded whichever way is shortest.
 
     Parameters:
+    window (bytes): Raw display data covering the window
+    first (int): First column of the window
+    last (int): Last column of the window
+    page_first (int): First page of the window
+    page_last (int): Last page of the window
     data (dict): Script-internal meta data
+
+    Returns:
+    int: Number of bytes sent
     """
-    data['cap'].release()
+    command, payload = encode_window(window, last - first + 1, data)
+    data['dev'].ctrl_transfer(USB_SEND, command, first | (last << 8), page_first | (page_last << 8), payload)
+    return len(payload)
 
 
-def main():
-    """
-    Put it all together:
-        - parse the command line parameters
-        - set up the callback functions based on the mode given in those parameters
-        - set up the USB connection
-        - and get going by calling all corresponding callback functions
+def send_pokes(row, first, last, page, data):
     """
-    args = parse_args()
+    Send a few changed bytes of a single page as setup-only CMD_POKE and
+    CMD_POKE_NEXT requests, which carry their data in the setup packet itself,
+    and therefore skip the data stage a CMD_WINDOW request needs.
 
-    # Some modes may have no need for an init and cleanup callback
-    # (single image and image series), so they can be None and skipped
-    mode_init = None
-    mode_cleanup = None
+    The requests always carry 2 and 4 bytes, so the bytes beyond the changed
+    ones are filled up with what the page already holds there anyway.
 
-    # Modes are mutually exclusive, so only one single of them should be ever set.
-    # Set up mandatory frame-processing callback (mode_process) for all of them,
-    # and the init / cleanup ones for those that need them (camera, video mode)
-    if args.camera is not None:
-        mode_init = init_camera
-        mode_process = process_video
-        mode_cleanup = cleanup_video
+    Parameters:
+    row (numpy.ndarray): The page's complete new data, one byte per column
+    first (int): First changed column
+    last (int): Last changed column
+    page (int): Page the columns are in
+    data (dict): Script-internal meta data
 
-    elif args.image is not None:
-        mode_process = process_single_image
+    Returns:
+    int: Number of bytes sent
+    """
+    # Anything beyond the display's last column is ignored by the device
+    padded = bytes(row[first:first + 2]).ljust(2, b'\0')
+    data['dev'].ctrl_transfer(USB_SEND, CMD_POKE, first | (page << 8), padded[0] | (padded[1] << 8))
+    sent = 2
 
-    elif args.imgseries is not None:
-        mode_process = process_image_series
+    for column in range(first + 2, last + 1, 4):
+        padded = bytes(row[column:column + 4]).ljust(4, b'\0')
+        data['dev'].ctrl_transfer(USB_SEND, CMD_POKE_NEXT, padded[0] | (padded[1] << 8),
+                padded[2] | (padded[3] << 8))
+        sent += 4
 
-    elif args.video is not None:
-        mode_init = init_video
-        mode_process = process_video
-        mode_cleanup = cleanup_video
+    return sent
 
-    elif args.reset:
-        mode_process = process_reset
 
-    else:
-        # This shouldn't happen - unless a new mode was introduced and its
-        # callback setup was forgotten to set up along the way here.
-        print("Uh oh, don't know what to do..")
-        sys.exit(1)
+def send_pages(current, pages, data):
+    """
+    Send a subset of a frame's pages as a CMD_PAGES request, encoded whichever
+    way is shortest.
 
+    Parameters:
+    current (numpy.ndarray): Frame data, shape (pages, columns)
+    pages (list): Page numbers to send, in ascending order
+    data (dict): Script-internal meta data
 
-    # Set up the script-internal meta data dictionary.
-    # This dictionary holds everything needed to handle the image processing
-    # and USB sending: parsed command line parameters, USB device object,
-    # display properties ..and anything that the init callback returns.
-    #
-    # If there is no init callback, mode_data gets simply initialized with
-    # an empty dictionary (and filled with more data later on)
-    if mode_init is not None:
-        mode_data = mode_init(args)
-    else:
-        mode_data = {}
+    Returns:
+    int: Number of bytes sent
+    """
+    mask = sum(1 << page for page in pages)
+    command, payload = encode_window(current[pages].tobytes(), data['res_x'], data)
+    data['dev'].ctrl_transfer(USB_SEND, CMD_PAGES, mask, command, payload)
+    return len(payload)
 
-    # Try to connect to the USB device.
-    # Quit if that fails, nothing we can do without it anyway.
-    dev = open_usb_device()
-    if dev is None:
-        print("Failed to open USB device")
-        sys.exit(1)
 
-    # Retrieve the display properties from the USB device
-    # and store it in the meta data dictionary.
-    mode_data.update(get_usb_device_properties(dev))
+def changed_windows(previous, current):
+    """
+    Find the windows of the display that differ between two frames.
+
+    Each page's changed columns are narrowed down to a range, and consecutive
+    changed pages are either merged into one window covering all their columns,
+    or kept as separate windows, whichever sends fewer bytes in total when every
+    window costs an additional WINDOW_OVERHEAD bytes. With only 8 pages at most,
+    simply trying out every way to group the changed pages is cheap enough.
+
+    Parameters:
+    previous (numpy.ndarray): Frame currently on the display, shape (pages, columns)
+    current (numpy.ndarray): New frame, same shape
+
+    Returns:
+    list: (first column, last column, first page, last page) tuple of each window
+    """
+    diff = previous != current
+    pages = [page for page in range(diff.shape[0]) if diff[page].any()]
+    ranges = {}
+    for page in pages:
+        columns = np.flatnonzero(diff[page])
+        ranges[page] = (int(columns[0]), int(columns[-1]))
+
+    # best[k] holds the cheapest cost and windows to cover the first k changed pages
+    best = [(0, [])]
+    for end in range(len(pages)):
+        candidates = []
+        for start in range(end + 1):
+            first = min(ranges[page][0] for page in pages[start:end + 1])
+            last = max(ranges[page][1] for page in pages[start:end + 1])
+            window = (first, last, pages[start], pages[end])
+            cost = (last - first + 1) * (pages[end] - pages[start] + 1) + WINDOW_OVERHEAD
+            candidates.append((best[start][0] + cost, best[start][1] + [window]))
+        best.append(min(candidates, key=lambda candidate: candidate[0]))
+
+    return best[-1][1]
+
+
+def changed_pixels(previous, current, limit):
+    """
+    Build a CMD_PIXELS pixel list of all pixels that differ between two frames,
+    as long as it stays shorter than a given limit.
+
+    Each pixel takes 2 bytes: its column, and its row combined with 0x80 if
+    it's set. The pixels are ordered by page and column, so the device sends
+    each changed display byte only once.
+
+    Parameters:
+    previous (numpy.ndarray): Frame currently on the display, shape (pages, columns)
+    current (numpy.ndarray): New frame, same shape
+    limit (int): Maximum length of the pixel list in bytes
+
+    Returns:
+    bytes: the pixel list, or None if it would reach the limit
+    """
+    # Unpacking only the changed bytes keeps this cheap for large changes, too
+    diff = previous ^ current
+    pages, columns = np.nonzero(diff)
+    if len(pages) * 2 >= limit:
+        return None
+
+    bits = np.unpackbits(diff[pages, columns][:, None], axis=1, bitorder='little')
+    if np.count_nonzero(bits) * 2 >= limit:
+        return None
+
+    byte, bit = np.nonzero(bits)
+    rows = pages[byte] * 8 + bit
+    values = (current[pages[byte], columns[byte]] >> bit) & 1
+    return np.stack([columns[byte], rows | (values << 7)], axis=1).astype(np.uint8).tobytes()
+
+
+def frame_columns(frame):
+    """
+    Turn a 64 pixel high frame into one 64-bit integer per column, with the
+    top-most pixel in the LSB, i.e. just reinterpret each column's 8 pages.
+
+    Parameters:
+    frame (numpy.ndarray): Frame data, shape (8, columns)
+
+    Returns:
+    numpy.ndarray: uint64 per column
+    """
+    return np.ascontiguousarray(frame.T).view('<u8')[:, 0]
+
+
+def columns_frame(columns):
+    """
+    Turn 64-bit integer columns back into frame data, see frame_columns().
+
+    Parameters:
+    columns (numpy.ndarray): uint64 per column
+
+    Returns:
+    numpy.ndarray: Frame data, shape (8, columns)
+    """
+    return np.ascontiguousarray(columns.astype('<u8').view(np.uint8).reshape(-1, 8).T)
+
+
+def rotate_columns(columns, rows):
+    """
+    Move all pixels of 64-bit integer columns down by the given number of
+    rows, wrapping around from the bottom to the top.
+
+    Parameters:
+    columns (numpy.ndarray): uint64 per column, or anything broadcastable with rows
+    rows (numpy.ndarray): Number of rows to move, 0-63
+
+    Returns:
+    numpy.ndarray: Rotated columns
+    """
+    rows = np.asarray(rows, dtype=np.uint64)
+    return (columns << rows) | (columns >> ((np.uint64(64) - rows) % np.uint64(64)))
+
+
+def rotate_frame(frame, rows):
+    """
+    Move all pixels of a 64 pixel high frame down by the given number of rows,
+    wrapping around from the bottom to the top. Used to translate between what
+    the display shows and what is in its RAM when the display start line is
+    changed: RAM row r is shown in display row r - start line.
+
+    Parameters:
+    frame (numpy.ndarray): Frame data, shape (8, columns)
+    rows (int): Number of rows to move, negative to move up
+
+    Returns:
+    numpy.ndarray: Rotated frame data
+    """
+    rows %= 64
+    if rows == 0:
+        return frame
+
+    return columns_frame(rotate_columns(frame_columns(frame), rows))
+
+
+def find_scroll(ram, current, start_line):
+    """
+    Check if the new frame is, at least mostly, the displayed one scrolled up
+    or down, so that changing the display start line and sending only what's
+    left to change is cheaper than sending the changes without scrolling.
+
+    Every possible start line is tried at once, by rotating the frame's
+    columns as 64-bit integers into the display RAM layout for each one, and
+    counting the bytes that would differ from the display RAM.
+
+    Parameters:
+    ram (numpy.ndarray): Current display RAM content, shape (8, columns)
+    current (numpy.ndarray): New frame, shape (8, columns)
+    start_line (int): Current display start line
+
+    Returns:
+    int: Number of rows to move the start line by, 0 if scrolling doesn't pay off
+    """
+    shifts = np.arange(64, dtype=np.uint64)[:, np.newaxis]
+    lines = (np.uint64(start_line) + shifts) % np.uint64(64)
+    targets = rotate_columns(frame_columns(current)[np.newaxis, :], lines)
+    changed = np.count_nonzero((targets ^ frame_columns(ram)).view(np.uint8).reshape(64, -1), axis=1)
+
+    best = int(np.argmin(changed))
+    if changed[0] - changed[best] > WINDOW_OVERHEAD:
+        return best
+
+    return 0
+
+
+def skip_frame(frame_data, current, data):
+    """
+    Check if sending a frame can be skipped since the device already shows it,
+    or with the --min-change command line parameter, something close enough.
+
+    Parameters:
+    frame_data (bytes): Raw frame data in the display's memory layout
+    current (numpy.ndarray): Same frame data, shape (pages, columns)
+    data (dict): Script-internal meta data
+
+    Returns:
+    bool: True if the frame doesn't need to be sent
+    """
+    # A plain comparison of the packed bytes is cheaper than hashing them first
+    if frame_data == data['shown_bytes']:
+        return True
+
+    if data['args'].min_change > 0:
+        changed = np.count_nonzero(np.unpackbits(data['shown'] ^ current))
+        return changed < data['args'].min_change
+
+    return False
+
+
+def send_frame(frame_data, data):
+    """
+    Send raw display data to the connected usbxbm device.
+
+    Unless the --full command line parameter is set, only the areas that changed
+    since the previously sent frame are transferred as CMD_WINDOW requests, and
+    frames identical to the previous one, or with --min-change, almost identical,
+    aren't sent at all. The very first frame is always sent in full, as is every
+    frame with --full, and with --keepalive, the first frame after the device
+    wasn't sent anything for that long. With --interlace, each frame only sends
+    every n-th page, alternating between the page sets from frame to frame, as
+    CMD_PAGES request. On displays supporting it, content that scrolled up or
+    down is scrolled on the display itself by changing its start line, and only
+    the newly exposed rows are sent. Either way, data is sent run-length or tile
+    encoded whenever that makes it shorter. If only a few scattered pixels
+    changed, those are sent as CMD_PIXELS pixel list instead of any windows,
+    and windows of only a few bytes within one page as setup-only CMD_POKE
+    requests. Frames that need several windows, or scrolling and a window,
+    send them all in one single CMD_BATCH request.
+
+    Parameters:
+    frame_data (bytes): Raw frame data in the display's memory layout
+    data (dict): Script-internal meta data
+    """
+    args = data['args']
+    stats = data.setdefault('transfers', collections.Counter())
+    current = np.frombuffer(frame_data, dtype=np.uint8).reshape(data['res_y'] // 8, data['res_x'])
+    ram = data.get('ram')
+    start_line = data.get('start_line', 0)
+    now = time.monotonic()
+    scrolled = False
+    windows = []
+    pages = []
+    pixels = None
+
+    stats['frames'] += 1
+    stats['raw'] += len(frame_data)
+
+    if ram is None or (args.keepalive > 0 and now - data['shown_time'] >= args.keepalive):
+        target = rotate_frame(current, start_line)
+        windows = [(0, data['res_x'] - 1, 0, data['res_y'] // 8 - 1)]
+    elif not args.full and skip_frame(frame_data, current, data):
+        # Keep comparing against what the device actually shows, so that
+        # skipped small changes still add up to a sent frame eventually
+        pass
+    else:
+        # Vertically scrolled content only needs the newly exposed rows sent
+        if data.get('features', 0) & DISPLAY_FEATURE_START_LINE and not args.full and args.interlace <= 1:
+            shift = find_scroll(ram, current, start_line)
+            if shift > 0:
+                start_line = (start_line + shift) % 64
+                data['start_line'] = start_line
+                stats['scrolls'] += 1
+                scrolled = True
+
+        target = rotate_frame(current, start_line)
+
+        if args.interlace > 1:
+            # Only this frame's field, and unless --full, only its changed pages
+            field = data.get('field', 0)
+            data['field'] = (field + 1) % args.interlace
+            pages = [page for page in range(field, current.shape[0], args.interlace)
+                     if args.full or (ram[page] != target[page]).any()]
+        elif args.full:
+            windows = [(0, data['res_x'] - 1, 0, data['res_y'] // 8 - 1)]
+        else:
+            windows = changed_windows(ram, target)
+
+            # Few scattered pixels are cheaper to send one by one,
+            # unless the windows are small enough to be poked anyway
+            cost = sum((last - first + 1) * (page_last - page_first + 1) +
+                       (0 if page_first == page_last and last - first < POKE_COLUMNS else WINDOW_OVERHEAD)
+                       for first, last, page_first, page_last in windows)
+            pixels = changed_pixels(ram, target, cost - WINDOW_OVERHEAD)
+            if pixels is not None:
+                windows = []
+
+    if windows or pixels:
+        # Keep a copy, the frame data's buffer may get reused for the next frame
+        ram = target.copy()
+    elif pages:
+        ram = ram.copy()
+        ram[pages] = target[pages]
+
+    # A frame that needs more than one request sends them all in a single batch
+    batch = Batch() if len(windows) + scrolled > 1 else None
+
+    if scrolled:
+        if batch is not None:
+            batch.scroll(start_line)
+        else:
+            data['dev'].ctrl_transfer(USB_SEND, CMD_SCROLL, start_line, 0)
+
+    for first, last, page_first, page_last in windows:
+        if batch is not None:
+            window = target[page_first:page_last + 1, first:last + 1].tobytes()
+            command, payload = encode_window(window, last - first + 1, data)
+            batch.window(first, last, page_first, page_last)
+            batch.data(command, payload)
+            stats['sent'] += len(payload)
+        elif page_first == page_last and last - first < POKE_COLUMNS:
+            stats['sent'] += send_pokes(target[page_first], first, last, page_first, data)
+            stats['pokes'] += 1
+        else:
+            window = target[page_first:page_last + 1, first:last + 1].tobytes()
+            stats['sent'] += send_window(window, first, last, page_first, page_last, data)
+
+    if batch is not None:
+        batch.send(data['dev'])
+        stats['batches'] += 1
+
+    if pages:
+        stats['sent'] += send_pages(target, pages, data)
+
+    if pixels:
+        data['dev'].ctrl_transfer(USB_SEND, CMD_PIXELS, 0, 0, pixels)
+        stats['sent'] += len(pixels)
+        stats['pixels'] += 1
+
+    if windows or pixels or pages or scrolled:
+        data['ram'] = ram
+        data['shown'] = rotate_frame(ram, -start_line)
+        data['shown_bytes'] = data['shown'].tobytes()
+        data['shown_time'] = now
+    else:
+        stats['skipped'] += 1
+
+    # If a --delay command line parameter was set, delay accordingly
+    if args.delay > 0:
+        time.sleep(args.delay)
+
+
+def stream_video_frame(frame, data):
+    """
+    Convert and send a given OpenCV video frame band by band, with the
+    --band command line parameter's number of pages per band.
+
+    The bands are converted one after the other in a worker thread, and each
+    one is sent as CMD_DATA request starting at its first page as soon as it's
+    ready, while the worker already converts the next one. So the first bands
+    are on the display before the last ones are even converted. Bands that
+    are already on the display are skipped, unless the device wasn't sent
+    anything for the --keepalive parameter's time.
+
+    Parameters:
+    frame (numpy.ndarray): BGR, BGRA, or grayscale frame as returned by OpenCV or FfmpegCapture
+    data (dict): Script-internal meta data
+    """
+    args = data['args']
+    stats = data.setdefault('transfers', collections.Counter())
+    pages = data['res_y'] // 8
+    now = time.monotonic()
+
+    # Single worker, so the bands get converted in order
+    if 'band_worker' not in data:
+        data['band_worker'] = concurrent.futures.ThreadPoolExecutor(max_workers=1)
+
+    bands = []
+    for page in range(0, pages, args.band):
+        rows = min(args.band, pages - page) * 8
+        bands.append((page, data['band_worker'].submit(pack_video_band, frame, page * 8, rows, data)))
+
+    ram = data.get('ram')
+    full = ram is None or (args.keepalive > 0 and now - data['shown_time'] >= args.keepalive)
+    ram = np.zeros((pages, data['res_x']), dtype=np.uint8) if ram is None else ram.copy()
+    sent = False
+
+    stats['frames'] += 1
+    stats['raw'] += pages * data['res_x']
+
+    for page, band in bands:
+        band_data = band.result()
+        current = np.frombuffer(band_data, dtype=np.uint8).reshape(-1, data['res_x'])
+        if not full and (ram[page:page + current.shape[0]] == current).all():
+            continue
+
+        data['dev'].ctrl_transfer(USB_SEND, CMD_DATA, page << 8, 0, band_data)
+        ram[page:page + current.shape[0]] = current
+        stats['sent'] += len(band_data)
+        sent = True
+
+    if sent:
+        data['ram'] = ram
+        data['shown'] = ram
+        data['shown_bytes'] = ram.tobytes()
+        data['shown_time'] = now
+    else:
+        stats['skipped'] += 1
+
+    # If a --delay command line parameter was set, delay accordingly
+    if args.delay > 0:
+        time.sleep(args.delay)
+
+
+def send_text(dev, text, column=0, page=0, invert=False):
+    """
+    Render text on the connected usbxbm device, using the device's built-in
+    5x8 font, so only the text itself is sent instead of a frame.
+
+    Each character takes up 6 columns, anything beyond the display's last
+    column is cut off, and characters outside of printable ASCII are shown
+    as question mark. An empty text sends nothing at all.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    text (str): Text to render, single line
+    column (int): Column where the text starts
+    page (int): Page, i.e. row of 8 pixels, where the text starts
+    invert (bool): Render light text on dark background instead
+    """
+    if not text:
+        return
+
+    dev.ctrl_transfer(USB_SEND, CMD_TEXT, column | (page << 8), 1 if invert else 0,
+            text.encode('ascii', errors='replace'))
+
+
+def fill_rect(dev, first, last, page_first, page_last, pattern=0xff):
+    """
+    Fill a rectangular area of the connected usbxbm device's display with a
+    byte pattern, generated by the device itself. Areas are given in columns
+    and pages, i.e. rows of 8 pixels, with each pattern byte covering one
+    column of a page, top-most pixel in the LSB.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    first (int): First column of the area
+    last (int): Last column of the area
+    page_first (int): First page of the area
+    page_last (int): Last page of the area
+    pattern (int): Byte to fill the area with, default 0xff sets all pixels
+    """
+    dev.ctrl_transfer(USB_SEND, CMD_FILL, first | (last << 8), page_first | (page_last << 4) | (pattern << 8))
+
+
+def invert_rect(dev, first, last, page_first, page_last):
+    """
+    Invert a rectangular area of the connected usbxbm device's display,
+    e.g. to highlight a selection.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    first (int): First column of the area
+    last (int): Last column of the area
+    page_first (int): First page of the area
+    page_last (int): Last page of the area
+    """
+    dev.ctrl_transfer(USB_SEND, CMD_INVERT, first | (last << 8), page_first | (page_last << 4))
+
+
+def clear_display(dev):
+    """
+    Clear the connected usbxbm device's display, i.e. unset all pixels.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    """
+    dev.ctrl_transfer(USB_SEND, CMD_CLEAR, 0, 0)
+
+
+def upload_asset(dev, offset, asset):
+    """
+    Upload data into the connected usbxbm device's asset pool. This stops any
+    animation that is currently running on the device.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    offset (int): Asset pool offset to store the data at
+    asset (bytes): Data to upload
+    """
+    if offset + len(asset) > ASSET_SIZE:
+        raise ValueError('asset of {} bytes at offset {} exceeds the {} byte asset pool'.format(
+            len(asset), offset, ASSET_SIZE))
+
+    dev.ctrl_transfer(USB_SEND, CMD_ASSET, offset, 0, asset)
+
+
+def start_animation(dev, frames, width, column=0, page=0, interval=100, offset=0):
+    """
+    Upload an animation to the connected usbxbm device and start it. The device
+    then keeps playing it in a loop on its own, even after the host is gone,
+    until it gets stopped, reset, or new assets are uploaded.
+
+    All frames share the same size and position, and get PackBits encoded, so
+    the whole animation has to fit the device's asset pool of ASSET_SIZE bytes
+    including a 4 byte header and 2 bytes per frame. Small sprites and frames
+    that differ little from each other work best.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    frames (list): Raw frame data of each frame, in the display's memory layout
+    width (int): Frame width in columns, each frame covers len(frame) // width pages
+    column (int): Column of the animation's top left corner
+    page (int): Page, i.e. row of 8 pixels, of the animation's top left corner
+    interval (int): Time each frame is shown, in milliseconds
+    offset (int): Asset pool offset to store the animation at
+
+    Returns:
+    int: size of the uploaded animation in bytes
+    """
+    pages = len(frames[0]) // width
+    asset = bytearray([column, column + width - 1, page | ((page + pages - 1) << 4), len(frames)])
+
+    for frame in frames:
+        encoded = rle_encode(frame)
+        asset += struct.pack('<H', len(encoded)) + encoded
+
+    upload_asset(dev, offset, bytes(asset))
+    dev.ctrl_transfer(USB_SEND, CMD_ANIMATE, offset, max(1, min(interval, 0xffff)))
+
+    return len(asset)
+
+
+def stop_animation(dev):
+    """
+    Stop the animation currently running on the connected usbxbm device.
+    Its last shown frame stays on the display.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    """
+    dev.ctrl_transfer(USB_SEND, CMD_ANIMATE, 0, 0)
+
+
+def upload_sprite(dev, sprite, image, offset=0, threshold=128):
+    """
+    Upload an image into the connected usbxbm device's asset pool and define
+    it as sprite, which can then be moved around with move_sprite(), costing
+    just a single setup packet each time, regardless of the sprite's size.
+
+    Sprites are drawn on top of the display's content with the set pixels
+    only, so they're best suited for icons and cursors on a light background.
+    Moving or hiding them restores the content underneath.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    sprite (int): Sprite number, 0 up to SPRITE_COUNT - 1
+    image (PIL.Image.Image): Sprite image, up to 255x255 pixels
+    offset (int): Asset pool offset to store the sprite image at
+    threshold (int): color threshold value, pixels up to this value are set
+
+    Returns:
+    int: size of the uploaded sprite image in bytes, to place the next one after it
+    """
+    # Pad the image with white up to full pages, pack_gray() only handles those
+    gray = image.convert('L')
+    canvas = Image.new('L', (gray.width, (gray.height + 7) // 8 * 8), 255)
+    canvas.paste(gray, (0, 0))
+
+    asset = bytes([gray.width, gray.height]) + pack_gray(np.asarray(canvas), threshold)
+    upload_asset(dev, offset, asset)
+    dev.ctrl_transfer(USB_SEND, CMD_SPRITE_SET, offset, sprite)
+
+    return len(asset)
+
+
+def move_sprite(dev, sprite, x, y):
+    """
+    Move a sprite on the connected usbxbm device to a given position and show
+    it there, if it wasn't shown yet. The device redraws both the old and new
+    area on its own.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    sprite (int): Sprite number, as defined with upload_sprite()
+    x (int): Column of the sprite's top left corner
+    y (int): Row of the sprite's top left corner, pixel precise
+    """
+    dev.ctrl_transfer(USB_SEND, CMD_SPRITE_MOVE, x | (y << 8), sprite)
+
+
+def hide_sprite(dev, sprite):
+    """
+    Hide a sprite on the connected usbxbm device, restoring the content underneath.
+
+    Parameters:
+    dev (usb.core.Device): USB device object
+    sprite (int): Sprite number, as defined with upload_sprite()
+    """
+    dev.ctrl_transfer(USB_SEND, CMD_SPRITE_HIDE, 0, sprite)
+
+
+def print_transfer_stats(data):
+    """
+    Print how many frames were skipped, and how many bytes were sent compared
+    to sending every frame raw and in full.
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    stats = data.get('transfers')
+    if stats and stats['raw'] > 0:
+        print('[transfer] {} frames, {} skipped, {} scrolled, {} as pixels, {} poked windows, '
+              '{} batched, {} of {} bytes sent, {} bytes ({:.1f}%) saved'.format(
+            stats['frames'], stats['skipped'], stats['scrolls'], stats['pixels'], stats['pokes'],
+            stats['batches'], stats['sent'], stats['raw'],
+            stats['raw'] - stats['sent'], 100 * (stats['raw'] - stats['sent']) / stats['raw']))
+
+
+class FrameCache:
+    """
+    Memory-bounded least-recently-used cache of converted frames.
+
+    Used when looping a playback, so that frames converted during the first pass
+    can simply be sent again in later ones. Keys should contain everything the
+    converted frame depends on: source, frame number, threshold, and resolution.
+    Once the cached frames exceed the memory budget, the least recently used ones
+    are evicted.
+    """
+
+    # Rough per-entry overhead of the dictionary, key, and value objects in bytes
+    ENTRY_OVERHEAD = 256
+
+    def __init__(self, budget):
+        """
+        Set up an empty cache.
+
+        Parameters:
+        budget (int): Memory budget in bytes
+        """
+        self.budget = budget
+        self.size = 0
+        self.entries = collections.OrderedDict()
+        self.hits = 0
+        self.misses = 0
+
+    def get(self, key):
+        """
+        Look up a cached frame.
+
+        Parameters:
+        key (tuple): Cache key
+
+        Returns:
+        the cached value, or None if it's not cached
+        """
+        value = self.entries.get(key)
+        if value is None:
+            self.misses += 1
+            return None
+
+        self.entries.move_to_end(key)
+        self.hits += 1
+        return value[0]
+
+    def put(self, key, value, size):
+        """
+        Add a frame to the cache, evicting the least recently used ones if needed.
+
+        Parameters:
+        key (tuple): Cache key
+        value: Value to cache
+        size (int): Size of the value in bytes
+        """
+        size += self.ENTRY_OVERHEAD
+        if size > self.budget:
+            return
+
+        if key in self.entries:
+            self.size -= self.entries.pop(key)[1]
+
+        self.entries[key] = (value, size)
+        self.size += size
+
+        while self.size > self.budget:
+            _, (_, evicted) = self.entries.popitem(last=False)
+            self.size -= evicted
+
+    def report(self):
+        """
+        Print the cache's hit rate and memory use.
+        """
+        lookups = self.hits + self.misses
+        if lookups > 0:
+            print('[cache] {} hits, {} misses, {:.1f}% hit rate, {} frames in {:.1f} of {:.1f} MiB'.format(
+                self.hits, self.misses, 100 * self.hits / lookups, len(self.entries),
+                self.size / 1048576, self.budget / 1048576))
+
+
+def send_image(image, data):
+    """
+    Send a given image to the connected usbxbm device.
+
+    Parameters:
+    image (PIL.Image.Image): Source image to convert and send via USB
+    data (dict): Script-internal meta data
+    """
+    send_frame(pack_frame(image, data), data)
+
+
+class FfmpegCapture:
+    """
+    Video capture object decoding a video file in an ffmpeg subprocess.
+
+    ffmpeg takes care of decoding, scaling the frames down to the display's
+    resolution, and converting them to 8-bit grayscale, and writes them as
+    raw video to its stdout, from where they're read one full frame at a time.
+    This follows the subset of the cv2.VideoCapture interface that the video
+    mode uses, so the two can be used interchangeably.
+    """
+
+    def __init__(self, path, res_x, res_y):
+        """
+        Set up the capture object and start the ffmpeg process.
+
+        Parameters:
+        path (str): Path to the video file
+        res_x (int): Display width to scale frames to
+        res_y (int): Display height to scale frames to
+        """
+        self.path = path
+        self.res_x = res_x
+        self.res_y = res_y
+        self.frame_size = res_x * res_y
+        self.process = None
+        self.frames = 0
+        self.fps = None
+        self.start()
+
+    def start(self):
+        """
+        Start (or restart) the ffmpeg process from the video's beginning.
+        """
+        self.release()
+        command = [
+                'ffmpeg', '-v', 'error', '-nostdin',
+                '-i', self.path,
+                '-vf', 'scale={}:{}:flags=area,format=gray'.format(self.res_x, self.res_y),
+                '-f', 'rawvideo', '-pix_fmt', 'gray', '-']
+        self.process = subprocess.Popen(command, stdout=subprocess.PIPE, bufsize=self.frame_size * 4)
+        self.frames = 0
+
+    def read(self):
+        """
+        Read the next frame from ffmpeg.
+
+        Returns:
+        tuple: (True, numpy.ndarray) with a display-sized grayscale frame,
+               or (False, None) if the video has ended
+        """
+        raw = self.process.stdout.read(self.frame_size)
+        if len(raw) < self.frame_size:
+            return False, None
+
+        self.frames += 1
+        return True, np.frombuffer(raw, dtype=np.uint8).reshape(self.res_y, self.res_x)
+
+    def grab(self):
+        """
+        Skip the next frame. ffmpeg still decodes it, but it's simply discarded here.
+
+        Returns:
+        bool: True if a frame was skipped, False if the video has ended
+        """
+        ret, _ = self.read()
+        return ret
+
+    def get(self, prop):
+        """
+        Get a capture property. Only the frame rate and the current position in
+        milliseconds are supported, the frame rate is looked up with ffprobe.
+
+        Parameters:
+        prop (int): OpenCV capture property identifier
+
+        Returns:
+        float: property value, or 0 if it's not supported or unknown
+        """
+        if self.fps is None:
+            self.fps = 0
+            if shutil.which('ffprobe') is not None:
+                command = [
+                        'ffprobe', '-v', 'error', '-select_streams', 'v:0',
+                        '-show_entries', 'stream=avg_frame_rate', '-of', 'csv=p=0', self.path]
+                rate = subprocess.run(command, stdout=subprocess.PIPE).stdout.decode().strip()
+                try:
+                    numerator, _, denominator = rate.partition('/')
+                    self.fps = float(numerator) / float(denominator or 1)
+                except (ValueError, ZeroDivisionError):
+                    pass
+
+        if prop == cv2.CAP_PROP_FPS:
+            return self.fps
+
+        if prop == cv2.CAP_PROP_POS_MSEC and self.fps > 0:
+            return (self.frames - 1) * 1000 / self.fps
+
+        return 0
+
+    def set(self, prop, value):
+        """
+        Set a capture property. Only rewinding to the first frame is supported.
+
+        Parameters:
+        prop (int): OpenCV capture property identifier
+        value: Value to set
+
+        Returns:
+        bool: True if the property was set
+        """
+        if prop == cv2.CAP_PROP_POS_FRAMES and value == 0:
+            self.start()
+            return True
+
+        return False
+
+    def release(self):
+        """
+        Stop the ffmpeg process, if there is one running.
+        """
+        if self.process is not None:
+            self.process.kill()
+            self.process.stdout.close()
+            self.process.wait()
+            self.process = None
+
+
+def capture_timestamp(cap):
+    """
+    Get the time the frame most recently read from a camera was captured.
+
+    V4L2 reports the capture time of each buffer on the same monotonic clock
+    Python uses, which also accounts for the time the frame sat in the driver's
+    buffer queue. If the backend doesn't do that, the current time is used.
+
+    Parameters:
+    cap (cv2.VideoCapture): Camera video capture object
+
+    Returns:
+    float: capture time in seconds on the time.monotonic() clock
+    """
+    now = time.monotonic()
+    timestamp = cap.get(cv2.CAP_PROP_POS_MSEC) / 1000
+    if 0 < now - timestamp < 1:
+        return timestamp
+
+    return now
+
+
+class CameraMailbox:
+    """
+    Latest-frame-wins wrapper around a camera video capture object.
+
+    A background thread keeps reading frames from the camera as fast as it
+    delivers them, and keeps only the most recent one in a single-slot mailbox,
+    replacing whatever frame wasn't taken yet. read() then always returns the
+    newest frame, so frames no longer pile up in the camera's buffer queue
+    while the previous one is being sent via USB.
+    This follows the subset of the cv2.VideoCapture interface that the video
+    mode uses, so the two can be used interchangeably.
+    """
+
+    # Seconds release() waits for the capture thread's current read to finish
+    RELEASE_TIMEOUT = 1
+
+    def __init__(self, cap):
+        """
+        Set up the mailbox and start the capture thread.
+
+        Parameters:
+        cap (cv2.VideoCapture): Camera video capture object
+        """
+        self.cap = cap
+        self.condition = threading.Condition()
+        self.frame = None
+        self.frame_captured = None
+        self.captured = None
+        self.dropped = 0
+        self.running = True
+        self.thread = threading.Thread(target=self.capture, daemon=True)
+        self.thread.start()
+
+    def capture(self):
+        """
+        Capture thread, reads frames until the camera fails or release() is called.
+        """
+        while self.running:
+            ret, frame = self.cap.read()
+            captured = capture_timestamp(self.cap)
+
+            with self.condition:
+                if not ret:
+                    self.running = False
+                elif self.frame is not None:
+                    # Previous frame was never taken, it's outdated now
+                    self.dropped += 1
+
+                self.frame = frame if ret else None
+                self.frame_captured = captured
+                self.condition.notify()
+
+    def read(self):
+        """
+        Wait for and take the most recent frame that wasn't taken yet.
+
+        Returns:
+        tuple: (True, numpy.ndarray) with the frame, or (False, None) if the camera failed
+        """
+        with self.condition:
+            while self.frame is None and self.running:
+                self.condition.wait()
+
+            if self.frame is None:
+                return False, None
+
+            frame = self.frame
+            self.captured = self.frame_captured
+            self.frame = None
+            return True, frame
+
+    def get(self, prop):
+        """
+        Get a capture property from the camera.
+        """
+        return self.cap.get(prop)
+
+    def set(self, prop, value):
+        """
+        Set a capture property on the camera.
+        """
+        return self.cap.set(prop, value)
+
+    def release(self):
+        """
+        Stop the capture thread and release the camera.
+
+        The capture thread only notices it's supposed to stop once its current
+        read() returns, which may never happen with a stalled camera. It's only
+        waited for RELEASE_TIMEOUT seconds then, and left behind as it is, along
+        with the camera, which can't be safely released while it's still being
+        read from. Being a daemon thread, it'll be gone once the script exits.
+        """
+        self.running = False
+        self.thread.join(self.RELEASE_TIMEOUT)
+        if self.thread.is_alive():
+            print('Warning: camera stalled, not releasing it')
+            return
+
+        self.cap.release()
+
+
+def set_camera_resolution(cap, res_x, res_y):
+    """
+    Set the camera to the smallest capture resolution that still covers the display.
+
+    The display's resolution itself is requested first, which the driver adjusts
+    to the closest one it supports. If that ends up smaller than the display,
+    the common capture resolutions are tried in ascending order instead.
+
+    Parameters:
+    cap (cv2.VideoCapture): Camera video capture object
+    res_x (int): Display width
+    res_y (int): Display height
+    """
+    for width, height in [(res_x, res_y)] + CAMERA_RESOLUTIONS:
+        if width < res_x or height < res_y:
+            continue
+
+        cap.set(cv2.CAP_PROP_FRAME_WIDTH, width)
+        cap.set(cv2.CAP_PROP_FRAME_HEIGHT, height)
+        if cap.get(cv2.CAP_PROP_FRAME_WIDTH) >= res_x and cap.get(cv2.CAP_PROP_FRAME_HEIGHT) >= res_y:
+            return
+
+
+def open_capture(args, props):
+    """
+    Open the video capture object for camera or video mode.
+
+    For camera mode, that's an OpenCV video capture object for the camera source id given
+    as command line parameter, set to the smallest resolution that covers the display and
+    wrapped in a CameraMailbox unless the --no-mailbox command line parameter is given.
+    For video mode, it depends on the --backend command line
+    parameter: either an OpenCV video capture object, or an ffmpeg-based one that already
+    delivers frames scaled to the display's resolution. If ffmpeg isn't available, OpenCV
+    is used regardless.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    props (dict): Display properties as returned by get_usb_device_properties()
+
+    Returns:
+    cv2.VideoCapture, CameraMailbox, or FfmpegCapture: the video capture object
+    """
+    if args.camera is not None:
+        cap = cv2.VideoCapture(args.camera)
+        set_camera_resolution(cap, props['res_x'], props['res_y'])
+        cap.set(cv2.CAP_PROP_BUFFERSIZE, 1)
+
+        if args.mailbox:
+            cap = CameraMailbox(cap)
+
+        return cap
+
+    if args.backend == 'ffmpeg':
+        if shutil.which('ffmpeg') is not None:
+            return FfmpegCapture(args.video, props['res_x'], props['res_y'])
+
+        print('Warning: ffmpeg not found, falling back to OpenCV')
+
+    return cv2.VideoCapture(args.video)
+
+
+def init_camera(args, props):
+    """
+    Initialization callback for camera mode.
+
+    Creates OpenCV video capture object from the given args information (camera source id)
+    that was passed from the command line parameters and returns it in a dictionary.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    props (dict): Display properties as returned by get_usb_device_properties()
+
+    Returns:
+    dict: Dictionary containing a cv2.VideoCapture or CameraMailbox object
+    """
+    return {'cap': open_capture(args, props)}
+
+
+def init_video(args, props):
+    """
+    Initialization callback for video mode.
+
+    Creates a video capture object from the given args information (video file)
+    that was passed from the command line parameters and returns it in a dictionary.
+    See open_capture() for which one it is.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    props (dict): Display properties as returned by get_usb_device_properties()
+
+    Returns:
+    dict: Dictionary containing a cv2.VideoCapture or FfmpegCapture object
+    """
+    return {'cap': open_capture(args, props)}
+
+
+def init_pipeline(args, props):
+    """
+    Initialization callback for camera and video mode with the --pipeline option.
+
+    Nothing to set up here, the video capture object is opened within the
+    decoding process itself.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    props (dict): Display properties as returned by get_usb_device_properties()
+
+    Returns:
+    dict: Empty dictionary
+    """
+    return {}
+
+
+class FramePacer:
+    """
+    Real-time frame scheduling for the --realtime option.
+
+    Each frame is due at the time of its timestamp, counted from when the video
+    (or its current loop iteration) started, measured with a monotonic clock.
+    Frames are held back until they're due, and if the playback fell behind by
+    more than a frame interval, the overdue frames are skipped altogether.
+    """
+
+    def __init__(self, fps):
+        """
+        Set up the pacer.
+
+        Parameters:
+        fps (float): Video frame rate
+        """
+        self.interval = 1 / fps
+        self.shown = 0
+        self.dropped = 0
+        self.jitter = []
+        self.restart()
+
+    def restart(self):
+        """
+        Start counting time from the video's beginning, i.e. now.
+        """
+        self.start = time.monotonic()
+        self.pts = 0.0
+        self.next_pts = 0.0
+
+    def behind(self):
+        """
+        Check if the next frame is already overdue by more than a frame interval.
+
+        Returns:
+        bool: True if the next frame should be skipped
+        """
+        return time.monotonic() - (self.start + self.next_pts) > self.interval
+
+    def update(self, cap, skipped):
+        """
+        Record the timestamp of the frame that was just retrieved or skipped.
+
+        Parameters:
+        cap (cv2.VideoCapture or FfmpegCapture): Video capture object
+        skipped (bool): True if the frame was skipped
+        """
+        # Not every backend reports timestamps, so fall back to counting frame intervals
+        pts = cap.get(cv2.CAP_PROP_POS_MSEC) / 1000
+        if pts <= 0:
+            pts = self.next_pts
+
+        self.schedule(pts, skipped)
+
+    def schedule(self, pts, skipped):
+        """
+        Record the timestamp of a frame that is about to be sent or was skipped.
+
+        Parameters:
+        pts (float): Frame timestamp in seconds since the video's beginning
+        skipped (bool): True if the frame was skipped
+        """
+        self.pts = pts
+        self.next_pts = pts + self.interval
+
+        if skipped:
+            self.dropped += 1
+
+    def wait(self):
+        """
+        Wait until the most recently retrieved frame is due.
+        """
+        due = self.start + self.pts
+        delay = due - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+        self.jitter.append(time.monotonic() - due)
+        self.shown += 1
+
+    def report(self):
+        """
+        Print how many frames were shown and dropped, and how far off their due time they were.
+        """
+        if self.jitter:
+            jitter = np.abs(np.array(self.jitter)) * 1000
+            print('[realtime] {} frames shown, {} dropped, jitter mean {:.1f}ms, max {:.1f}ms'.format(
+                self.shown, self.dropped, jitter.mean(), jitter.max()))
+
+
+def video_frames(cap, args, pacer=None):
+    """
+    Generator retrieving all frames from the given video capture object.
+
+    If retrieving a frame fails in video mode, it's assumed that the video itself
+    was finished sending, and it either starts over (if the --loop command line
+    parameter was given), or stops.
+
+    If a frame pacer is given, frames it considers overdue are skipped with grab(),
+    so they don't even get fully decoded.
+
+    Parameters:
+    cap (cv2.VideoCapture or FfmpegCapture): Video capture object
+    args (argparse.Namespace): Parsed command line argument object
+    pacer (FramePacer): Optional frame pacer
+
+    Yields:
+    numpy.ndarray: the next frame
+    """
+    while True:
+        # Skip the next frame if it's already overdue
+        if pacer is not None and pacer.behind():
+            if cap.grab():
+                pacer.update(cap, True)
+                continue
+
+            ret = False
+        else:
+            # Get the next frame from the video source
+            ret, frame = cap.read()
+
+        if not ret:
+            # No frame retrieved.
+            # If source is a video file, end of file was presumably reached.
+            # Check if --loop parameter was given and rewind back to the first frame
+            if args.video is not None and args.loop:
+                cap.set(cv2.CAP_PROP_POS_FRAMES, 0)
+                if pacer is not None:
+                    pacer.restart()
+                continue
+
+            # Either not a video or no --loop option given, we're done then
+            return
+
+        if pacer is not None:
+            pacer.update(cap, False)
+
+        yield frame
+
+
+def seek_video(cap, position, number):
+    """
+    Position a video capture object so its next read() returns a given frame.
+
+    Parameters:
+    cap (cv2.VideoCapture or FfmpegCapture): Video capture object
+    position (int): Number of the frame the next read() currently returns, None if unknown
+    number (int): Number of the frame to go to
+
+    Returns:
+    int: number of the frame the next read() returns now
+    """
+    if position is None or position > number:
+        cap.set(cv2.CAP_PROP_POS_FRAMES, 0)
+        position = 0
+
+    # Not every backend can seek to any frame, so skip ahead frame by frame if needed
+    if number > position and cap.set(cv2.CAP_PROP_POS_FRAMES, number):
+        return number
+
+    while position < number and cap.grab():
+        position += 1
+
+    return position
+
+
+def cached_video_frames(data, pacer=None):
+    """
+    Generator looping through a video forever, yielding converted frames from the frame cache.
+
+    Frames that aren't cached (yet) are decoded, converted, and added to the cache, so
+    once the whole video fits into the cache, later passes don't touch the video at all.
+
+    Parameters:
+    data (dict): Script-internal meta data, including the video capture object and frame cache
+    pacer (FramePacer): Optional frame pacer
+
+    Yields:
+    bytes: raw frame data of the next frame to send
+    """
+    cap = data['cap']
+    args = data['args']
+    cache = data['cache']
+    source = os.path.abspath(args.video)
+    fps = cap.get(cv2.CAP_PROP_FPS)
+
+    # Number of frames in the video, unknown until the first pass reaches the end
+    frame_count = None
+    # Number of the frame the capture object's next read() returns
+    position = 0
+    # Number of the next frame to send
+    number = 0
+
+    if pacer is not None:
+        pacer.restart()
+
+    while True:
+        if number == frame_count:
+            # End of the video, start over
+            number = 0
+            if pacer is not None:
+                pacer.restart()
+
+        key = (source, number, args.threshold, data['res_x'], data['res_y'])
+        entry = cache.get(key)
+
+        if entry is None:
+            if position != number:
+                position = seek_video(cap, position, number)
+
+            ret, frame = cap.read()
+            if not ret:
+                if number == 0:
+                    # Nothing to play at all
+                    return
+
+                frame_count = number
+                position = None
+                continue
+
+            position = number + 1
+            pts = cap.get(cv2.CAP_PROP_POS_MSEC) / 1000
+            if pts <= 0 and fps > 0:
+                pts = number / fps
+
+            entry = (pts, pack_video_frame(frame, data))
+            cache.put(key, entry, len(entry[1]))
+
+        number += 1
+
+        if pacer is not None:
+            skipped = pacer.behind()
+            pacer.schedule(entry[0], skipped)
+            if skipped:
+                continue
+            pacer.wait()
+
+        yield entry[1]
+
+
+def process_video(data):
+    """
+    Frame-processing callback for video capture modes (camera and video)
+
+    Retrieves frames from the video capture object referenced in the given meta data
+    dictionary and sends them to the device, until video_frames() runs out of them.
+
+    With the --realtime option in video mode, frames are sent according to the
+    video's frame rate, see FramePacer. With the --loop option in video mode,
+    converted frames are cached for later passes, see cached_video_frames().
+    With the --band option, frames are converted and sent band by band instead,
+    see stream_video_frame().
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    pacer = None
+    if data['args'].realtime and data['args'].video is not None:
+        fps = data['cap'].get(cv2.CAP_PROP_FPS)
+        if fps > 0:
+            pacer = FramePacer(fps)
+        else:
+            print('Warning: unknown video frame rate, ignoring --realtime')
+
+    # In camera mode, keep track of the time between capturing a frame and having it sent
+    latencies = [] if data['args'].camera is not None else None
+
+    try:
+        if data.get('cache') is not None and data['args'].video is not None:
+            for frame_data in cached_video_frames(data, pacer):
+                send_frame(frame_data, data)
+            return
+
+        for frame in video_frames(data['cap'], data['args'], pacer):
+            if latencies is not None:
+                if isinstance(data['cap'], CameraMailbox):
+                    captured = data['cap'].captured
+                else:
+                    captured = capture_timestamp(data['cap'])
+
+            if data['args'].band > 0:
+                # Wait for the frame to be due, and convert and send it band by band
+                if pacer is not None:
+                    pacer.wait()
+                stream_video_frame(frame, data)
+            else:
+                # Convert the video frame, wait for it to be due, and send it
+                frame_data = pack_video_frame(frame, data)
+                if pacer is not None:
+                    pacer.wait()
+                send_frame(frame_data, data)
+
+            if latencies is not None:
+                latencies.append(time.monotonic() - captured)
+
+    finally:
+        if pacer is not None:
+            pacer.report()
+
+        if latencies:
+            dropped = data['cap'].dropped if isinstance(data['cap'], CameraMailbox) else 0
+            print('[camera] {} frames sent, {} outdated frames dropped, median capture-to-display latency {:.1f}ms'.format(
+                len(latencies), dropped, np.median(latencies) * 1000))
+
+        if data.get('cache') is not None:
+            data['cache'].report()
+
+        # Don't leave the --band conversion thread behind
+        if 'band_worker' in data:
+            data.pop('band_worker').shutdown()
+
+
+class SharedRing:
+    """
+    Ring buffer of preallocated, equally sized frame slots in shared memory.
+
+    Slots are handed between a producer and a consumer process by passing
+    their index through two queues: the producer takes an index from the free
+    queue, fills the slot, and puts the index in the full queue, from where the
+    consumer takes it, handles the slot's content, and returns the index back
+    to the free queue. A None index in the full queue marks the end of frames.
+    """
+
+    def __init__(self, depth, slot_shape):
+        """
+        Allocate the shared memory and mark all slots as free.
+
+        Parameters:
+        depth (int): Number of frame slots
+        slot_shape (tuple): numpy array shape of a single slot
+        """
+        self.slot_shape = slot_shape
+        self.slot_size = int(np.prod(slot_shape))
+        self.shm = shared_memory.SharedMemory(create=True, size=depth * self.slot_size)
+        self.free = multiprocessing.Queue()
+        self.full = multiprocessing.Queue()
+
+        for index in range(depth):
+            self.free.put(index)
+
+    def slot(self, index):
+        """
+        Get a numpy view of a given slot.
+
+        Parameters:
+        index (int): Slot index
+
+        Returns:
+        numpy.ndarray: uint8 array of the slot's shape, backed by the shared memory
+        """
+        return np.ndarray(self.slot_shape, dtype=np.uint8, buffer=self.shm.buf, offset=index * self.slot_size)
+
+    def destroy(self):
+        """
+        Release and remove the shared memory.
+        """
+        self.shm.close()
+        self.shm.unlink()
+
+
+def pipeline_get(slot_queue, stop):
+    """
+    Wait for the next slot index in a given queue, unless the pipeline is stopped.
+
+    Parameters:
+    slot_queue (multiprocessing.Queue): Queue to take the index from
+    stop (multiprocessing.Event): Pipeline stop event
+
+    Returns:
+    int: slot index, or None if the frames ended or the pipeline was stopped
+    """
+    while not stop.is_set():
+        try:
+            return slot_queue.get(timeout=0.1)
+        except queue.Empty:
+            pass
+
+    return None
+
+
+def pipeline_decode(args, props, decoded, stop, busy):
+    """
+    Decoding process of the --pipeline option.
+
+    Reads frames from the video source, scales them down to the display's
+    resolution, and stores them as 3-channel BGR in the decoded ring buffer.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    props (dict): Display properties as returned by get_usb_device_properties()
+    decoded (SharedRing): Ring buffer to store decoded frames in
+    stop (multiprocessing.Event): Pipeline stop event
+    busy (multiprocessing.Array): Per-stage busy time in seconds, decoding is index 0
+    """
+    # CTRL+C is handled by the main process, which then stops the pipeline
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+
+    cap = open_capture(args, props)
+    size = (props['res_x'], props['res_y'])
+    frames = video_frames(cap, args)
+
+    while True:
+        index = pipeline_get(decoded.free, stop)
+        if index is None:
+            break
+
+        start = time.perf_counter()
+        frame = next(frames, None)
+        if frame is None:
+            decoded.free.put(index)
+            break
+
+        if frame.shape[:2] != (props['res_y'], props['res_x']):
+            frame = cv2.resize(frame, size, interpolation=cv2.INTER_AREA)
+
+        if frame.ndim == 2:
+            frame = cv2.cvtColor(frame, cv2.COLOR_GRAY2BGR)
+        elif frame.shape[2] == 4:
+            frame = cv2.cvtColor(frame, cv2.COLOR_BGRA2BGR)
+
+        decoded.slot(index)[:] = frame
+        busy[0] += time.perf_counter() - start
+        decoded.full.put(index)
+
+    decoded.full.put(None)
+    cap.release()
+
+
+def pipeline_convert(args, props, decoded, packed, stop, busy):
+    """
+    Conversion process of the --pipeline option.
+
+    Takes display-sized frames from the decoded ring buffer, turns them into
+    raw display data, and stores that in the packed ring buffer.
+
+    Parameters:
+    args (argparse.Namespace): Parsed command line argument object
+    props (dict): Display properties as returned by get_usb_device_properties()
+    decoded (SharedRing): Ring buffer to take decoded frames from
+    packed (SharedRing): Ring buffer to store raw display data in
+    stop (multiprocessing.Event): Pipeline stop event
+    busy (multiprocessing.Array): Per-stage busy time in seconds, conversion is index 1
+    """
+    signal.signal(signal.SIGINT, signal.SIG_IGN)
+
+    data = {'res_x': props['res_x'], 'res_y': props['res_y'], 'args': args}
+
+    while True:
+        source = pipeline_get(decoded.full, stop)
+        if source is None:
+            break
+
+        target = pipeline_get(packed.free, stop)
+        if target is None:
+            break
+
+        start = time.perf_counter()
+        packed.slot(target)[:] = np.frombuffer(pack_video_frame(decoded.slot(source), data), dtype=np.uint8)
+        busy[1] += time.perf_counter() - start
+
+        decoded.free.put(source)
+        packed.full.put(target)
+
+    packed.full.put(None)
+
+
+def print_pipeline_stats(busy, frames, elapsed, end='\r'):
+    """
+    Print the utilization of each pipeline stage.
+
+    Parameters:
+    busy (multiprocessing.Array): Per-stage busy time in seconds
+    frames (int): Number of frames sent so far
+    elapsed (float): Time in seconds since the pipeline started
+    end (str): Line ending, carriage return by default to keep updating the same line
+    """
+    if elapsed > 0:
+        print('[pipeline] decode {:3.0f}%  convert {:3.0f}%  send {:3.0f}%  {} frames, {:.1f} fps'.format(
+            100 * busy[0] / elapsed, 100 * busy[1] / elapsed, 100 * busy[2] / elapsed,
+            frames, frames / elapsed), end=end, flush=True)
+
+
+def process_pipeline(data):
+    """
+    Frame-processing callback for video capture modes (camera and video) with the --pipeline option.
+
+    Unlike process_video(), decoding, converting, and sending each frame happens in three
+    separate processes, connected by shared memory ring buffers, so that e.g. the next frame
+    is decoded while the current one is sent via USB. Decoding and conversion run in their
+    own processes (see pipeline_decode() and pipeline_convert()), while the sending itself
+    stays here in the main process, where the USB device is.
+
+    The utilization of each stage, i.e. the share of time it spent working rather than
+    waiting for another stage, is printed once a second, and once more when it all ends.
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    props = {'res_x': data['res_x'], 'res_y': data['res_y']}
+    decode_depth, convert_depth = data['args'].pipeline
+
+    decoded = SharedRing(decode_depth, (data['res_y'], data['res_x'], 3))
+    packed = SharedRing(convert_depth, (data['res_x'] * data['res_y'] // 8,))
+    stop = multiprocessing.Event()
+    busy = multiprocessing.Array('d', 3)
+
+    stages = [
+        multiprocessing.Process(target=pipeline_decode, args=(data['args'], props, decoded, stop, busy)),
+        multiprocessing.Process(target=pipeline_convert, args=(data['args'], props, decoded, packed, stop, busy)),
+    ]
+
+    for stage in stages:
+        stage.start()
+
+    frames = 0
+    started = time.perf_counter()
+    last_stats = started
+
+    try:
+        while True:
+            index = pipeline_get(packed.full, stop)
+            if index is None:
+                break
+
+            start = time.perf_counter()
+            send_frame(packed.slot(index).tobytes(), data)
+            busy[2] += time.perf_counter() - start
+
+            packed.free.put(index)
+            frames += 1
+
+            if start - last_stats >= 1:
+                print_pipeline_stats(busy, frames, start - started)
+                last_stats = start
+
+    finally:
+        # Stop the other stages in case the pipeline ended here first (i.e. CTRL+C)
+        stop.set()
+        for stage in stages:
+            stage.join(timeout=1)
+            if stage.is_alive():
+                stage.terminate()
+
+        print_pipeline_stats(busy, frames, time.perf_counter() - started, end='\n')
+        decoded.destroy()
+        packed.destroy()
+
+
+def process_single_image(data):
+    """
+    Frame-processing callback for single image mode.
+
+    Opens the image file defined in the parsed command line parameters (stored within
+    the given meta data dictionary) and sends it to the device.
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    image = open_image(data['args'].image, data)
+    send_image(image, data)
+
+
+def process_image_series(data):
+    """
+    Frame-processing callback for image series mode.
+
+    Loops through the directory defined in the parsed command line parameters (stored within
+    the given meta data dictionary), opens each *.jpg file (currently only considers JPG files
+    but could be adjusted if e.g. PNG is also needed) ands ends it to the device either until
+    every single picture in the directory is sent, or (depending on another parameter) for all
+    eternity (or until CTRL+C is hit).
+
+    The files are processed in alphabetical order, and an image series itself could be easily
+    generated with ffmpeg using printf-style formatting as output name:
+        ffmpeg -i /path/to/video xxx_%05d.jpg
+    or with some optional cropping or scaling:
+        ffmpeg -i /path/to/video -vf crop:460:360,scale=128:64 xxx_%05d.jpg
+
+    With the --jobs option, images are converted ahead of sending them by a pool of worker
+    processes, with at most four images per worker in flight, keeping their alphabetical order.
+
+    With the --loop option, converted images are kept in the frame cache, so later passes
+    only need to send them again, as long as the cache's memory budget allows it.
+
+    Note that unlike the video mode, the video frame rate is ignored in the image series mode
+    and pre-scaling the image could slightly speed up the processing time, and by that the
+    frame rate itself - although the OLED is mostly limited to the i2c clock speed and won't
+    benefit much here. The SPI-connected Nokia LCD on the other hand could gain a frame or
+    two by pre-scaling the image.
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    args = data['args']
+    cache = data.get('cache')
+    lite = {'res_x': data['res_x'], 'res_y': data['res_y'], 'args': args}
+
+    def cache_key(path):
+        return (os.path.abspath(path), 0, args.threshold, data['res_x'], data['res_y'])
+
+    def lookup(job):
+        return cache.get(cache_key(job[0])) if cache is not None else None
+
+    try:
+        keep_going = True
+        while keep_going:
+            files = sorted(glob.glob(args.imgseries + "/*.jpg"))
+            # Convert the upcoming images in parallel (if --jobs asks for it), unless they're cached
+            frames = ordered_map(pack_image_job, ((path, lite) for path in files), args.jobs, args.jobs * 4, lookup)
+
+            for infile, frame_data in zip(files, frames):
+                if cache is not None:
+                    cache.put(cache_key(infile), frame_data, len(frame_data))
+
+                send_frame(frame_data, data)
+
+            if not args.loop:
+                keep_going = False
+
+    finally:
+        if cache is not None:
+            cache.report()
+
+
+def ordered_map(function, items, jobs, window, lookup=None):
+    """
+    Generator applying a function to all given items in parallel, yielding results in order.
+
+    Up to window items are handed to a pool of jobs worker processes ahead of the
+    result currently yielded, so items are only taken from the given iterable as
+    results are consumed, and memory use stays flat regardless of the item count.
+    With a single job, everything simply runs right here in sequence.
+
+    If a lookup function is given, it's called for each item first, and if it
+    returns anything other than None (e.g. from a cache), that is used as result
+    instead of calling the function at all.
+
+    Parameters:
+    function (callable): Picklable function taking a single item
+    items (iterable): Items to process
+    jobs (int): Number of worker processes
+    window (int): Maximum number of items in flight
+    lookup (callable): Optional function taking a single item and returning its result, or None
+
+    Yields:
+    the function's result for each item, in the items' order
+    """
+    if jobs <= 1:
+        for item in items:
+            result = lookup(item) if lookup is not None else None
+            yield result if result is not None else function(item)
+        return
+
+    with concurrent.futures.ProcessPoolExecutor(jobs) as executor:
+        pending = collections.deque()
+        for item in items:
+            result = lookup(item) if lookup is not None else None
+            pending.append(result if result is not None else executor.submit(function, item))
+
+            while len(pending) >= window or (pending and not isinstance(pending[0], concurrent.futures.Future)):
+                result = pending.popleft()
+                yield result.result() if isinstance(result, concurrent.futures.Future) else result
+
+        while pending:
+            result = pending.popleft()
+            yield result.result() if isinstance(result, concurrent.futures.Future) else result
+
+
+def pack_image_job(job):
+    """
+    Worker function converting an image file, see ordered_map().
+
+    Parameters:
+    job (tuple): (image file path, script-internal meta data without USB device)
+
+    Returns:
+    bytes: raw frame data in the display's memory layout
+    """
+    path, data = job
+    return pack_frame(open_image(path, data), data)
+
+
+def pack_video_job(job):
+    """
+    Worker function converting a video frame, see ordered_map().
+
+    Parameters:
+    job (tuple): (video frame, script-internal meta data without USB device)
+
+    Returns:
+    bytes: raw frame data in the display's memory layout
+    """
+    frame, data = job
+    return pack_video_frame(frame, data)
+
+
+def record_frames(data):
+    """
+    Generator converting all frames of the mode's input source for recording.
+
+    Frames are converted in parallel if the --jobs command line parameter asks for it,
+    except in camera mode, where frames are simply captured until CTRL+C is hit.
+    Looping is ignored, every source frame is recorded once.
+
+    Timestamps are the frames' timestamps within the video in video mode, the time
+    since recording started in camera mode, and multiples of the --delay command
+    line parameter in image series mode.
+
+    Parameters:
+    data (dict): Script-internal meta data
+
+    Yields:
+    tuple: (timestamp in seconds, raw frame data)
+    """
+    args = copy.copy(data['args'])
+    args.loop = False
+    jobs = args.jobs
+    lite = {'res_x': data['res_x'], 'res_y': data['res_y'], 'args': args}
+
+    if args.imgseries is not None:
+        files = sorted(glob.glob(args.imgseries + "/*.jpg"))
+        frames = ordered_map(pack_image_job, ((path, lite) for path in files), jobs, jobs * 4)
+        for number, frame_data in enumerate(frames):
+            yield number * args.delay, frame_data
+
+    elif args.camera is not None:
+        started = time.monotonic()
+        for frame in video_frames(data['cap'], args):
+            yield time.monotonic() - started, pack_video_frame(frame, lite)
+
+    else:
+        cap = data['cap']
+        fps = cap.get(cv2.CAP_PROP_FPS)
+        timestamps = collections.deque()
+
+        def frames():
+            # Keep each frame's timestamp while it's on its way through the worker pool
+            for number, frame in enumerate(video_frames(cap, args)):
+                timestamp = cap.get(cv2.CAP_PROP_POS_MSEC) / 1000
+                if timestamp <= 0 and fps > 0:
+                    timestamp = number / fps
+                timestamps.append(timestamp)
+                yield frame, lite
+
+        for frame_data in ordered_map(pack_video_job, frames(), jobs, jobs * 4):
+            yield timestamps.popleft(), frame_data
+
+
+def process_record(data):
+    """
+    Frame-processing callback for any mode with the --record option.
+
+    Instead of sending the converted frames to the device, they're written
+    into an .xbmv file, which can be played back later with --xbmv mode.
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    writer = xbmv.XbmvWriter(data['args'].record, data['res_x'], data['res_y'])
+
+    try:
+        for timestamp, frame_data in record_frames(data):
+            writer.write(frame_data, timestamp)
+            print('\r[record] {} frames'.format(len(writer.index)), end='', flush=True)
+
+    finally:
+        writer.close()
+        print('\r[record] {} frames written to {}'.format(len(writer.index), data['args'].record))
+
+
+def process_xbmv(data):
+    """
+    Frame-processing callback for .xbmv playback mode.
+
+    Maps the .xbmv file defined in the parsed command line parameters (stored within
+    the given meta data dictionary) into memory, and hands each frame as-is to the
+    device as CMD_DATA request, without any decoding, conversion, or comparing, so
+    playback takes next to no CPU time. With the --diff command line parameter,
+    frames go through send_frame() instead, like in all other modes, trading CPU
+    time for sending only what changed. By default, frames are sent as fast as the
+    device takes them, with the --realtime command line parameter, each one is
+    sent at its recorded timestamp instead, and if playback falls behind, it skips
+    ahead to the frame that is due by then, using the file's frame index.
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    try:
+        reader = xbmv.XbmvReader(data['args'].xbmv)
+    except (OSError, ValueError) as e:
+        print('Error: {}'.format(e))
+        return
+
+    if (reader.res_x, reader.res_y) != (data['res_x'], data['res_y']):
+        print('Error: {} was recorded for {}x{}, but display is {}x{}'.format(
+            data['args'].xbmv, reader.res_x, reader.res_y, data['res_x'], data['res_y']))
+        reader.close()
+        return
+
+    skipped = 0
+
+    try:
+        keep_going = reader.frame_count > 0
+        while keep_going:
+            started = time.monotonic()
+            number = 0
+            while number < reader.frame_count:
+                timestamp, frame_data = reader.frame(number)
+
+                if data['args'].realtime:
+                    delay = started + timestamp - time.monotonic()
+                    if delay > 0:
+                        time.sleep(delay)
+                    else:
+                        # Running late, so skip ahead to the frame that's due by now
+                        due = reader.seek(time.monotonic() - started)
+                        if due > number:
+                            skipped += due - number
+                            number = due
+                            timestamp, frame_data = reader.frame(number)
+
+                if data['args'].diff:
+                    send_frame(frame_data, data)
+                else:
+                    data['dev'].ctrl_transfer(USB_SEND, CMD_DATA, 0, 0, frame_data)
+                number += 1
+
+            if not data['args'].loop:
+                keep_going = False
+
+    finally:
+        frame_data = None
+        reader.close()
+
+        if skipped > 0:
+            print('[realtime] {} frames skipped to keep up'.format(skipped))
+
+
+def process_reset(data):
+    """
+    Frame-processing callback for reset mode.
+
+    Doesn't really process anything, just sends a CMD_RESET request to the device.
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    print('-> [RESET]')
+    data['dev'].ctrl_transfer(USB_SEND, CMD_RESET, 0, 0)
+
+
+def process_text(data):
+    """
+    Frame-processing callback for text mode.
+
+    Sends each line of the text given in the --text command line parameter to
+    be rendered on the device itself, starting at the --position parameter's
+    page and going down one page per line. With --clear, the display is
+    cleared first.
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    column, page = data['args'].position
+    pages = data['res_y'] // 8
+
+    if data['args'].clear:
+        print('-> [CLEAR]')
+        clear_display(data['dev'])
+
+    for line in data['args'].text.split('\n'):
+        if page >= pages or column >= data['res_x']:
+            break
+        # Empty lines just leave their page as it is
+        if line:
+            print('-> [TEXT] {}'.format(line))
+            send_text(data['dev'], line, column, page)
+        page += 1
+
+
+def process_animation(data):
+    """
+    Frame-processing callback for animation mode.
+
+    Converts all frames of the animated image (e.g. a GIF) given in the
+    --animation command line parameter and uploads them to the device, which
+    then plays them on its own at the --position parameter's column and page.
+    Images smaller than the display keep their size, with the height rounded
+    up to full pages, larger ones are scaled down to fit the display.
+    Each frame is shown for the image's own frame duration, or --delay if set.
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    args = data['args']
+    column, page = args.position
+    image = Image.open(args.animation)
+
+    width = min(image.width, data['res_x'] - column)
+    height = min((image.height + 7) // 8 * 8, data['res_y'] - page * 8)
+    if width <= 0 or height <= 0:
+        print('Error: position {},{} is outside of the display'.format(column, page))
+        return
+
+    frames = []
+    for frame in ImageSequence.Iterator(image):
+        # Paste smaller frames on a white canvas instead of stretching them
+        gray = frame.convert('L')
+        if gray.width > width or gray.height > height:
+            gray = gray.resize((width, height))
+        canvas = Image.new('L', (width, height), 255)
+        canvas.paste(gray, (0, 0))
+        frames.append(pack_gray(np.asarray(canvas), args.threshold))
+
+    if args.delay > 0:
+        interval = int(args.delay * 1000)
+    else:
+        interval = image.info.get('duration') or 100
+
+    try:
+        size = start_animation(data['dev'], frames, width, column, page, interval)
+    except ValueError as error:
+        print('Error: {} frames of {}x{} pixels: {}'.format(len(frames), width, height, error))
+        return
+
+    print('-> [ANIMATE] {} frames of {}x{} pixels, {} bytes, {}ms per frame'.format(
+        len(frames), width, height, size, interval))
+
+
+def cleanup_video(data):
+    """
+    Cleanup callback for modes that handle OpenCV video (camera, video)
+
+    Releases the video capture object referenced in the given data parameter
+
+    Parameters:
+    data (dict): Script-internal meta data
+    """
+    data['cap'].release()
+
+
+def main():
+    """
+    Put it all together:
+        - parse the command line parameters
+        - set up the callback functions based on the mode given in those parameters
+        - set up the USB connection
+        - and get going by calling all corresponding callback functions
+    """
+    args = parse_args()
+
+    if args.jobs < 1:
+        args.jobs = os.cpu_count() or 1
+
+    if args.band < 0:
+        args.band = 0
+
+    # Some modes may have no need for an init and cleanup callback
+    # (single image and image series), so they can be None and skipped
+    mode_init = None
+    mode_cleanup = None
+
+    # Modes are mutually exclusive, so only one single of them should be ever set.
+    # Set up mandatory frame-processing callback (mode_process) for all of them,
+    # and the init / cleanup ones for those that need them (camera, video mode)
+    if args.camera is not None:
+        mode_init = init_camera
+        mode_process = process_video
+        mode_cleanup = cleanup_video
+
+    elif args.image is not None:
+        mode_process = process_single_image
+
+    elif args.imgseries is not None:
+        mode_process = process_image_series
+
+    elif args.video is not None:
+        mode_init = init_video
+        mode_process = process_video
+        mode_cleanup = cleanup_video
+
+    elif args.xbmv is not None:
+        mode_process = process_xbmv
+
+    elif args.text is not None:
+        mode_process = process_text
+
+    elif args.animation is not None:
+        mode_process = process_animation
+
+    elif args.reset:
+        mode_process = process_reset
+
+    else:
+        # This shouldn't happen - unless a new mode was introduced and its
+        # callback setup was forgotten to set up along the way here.
+        print("Uh oh, don't know what to do..")
+        sys.exit(1)
+
+    # With the --record option, camera, video, and image series mode write their
+    # converted frames into a file instead of sending them to the device
+    if args.record is not None and mode_process in (process_video, process_image_series):
+        mode_process = process_record
+
+    # With the --pipeline option, camera and video mode handle their frames in the
+    # multi-process pipeline instead, which opens the video source on its own
+    elif args.pipeline is not None and mode_process == process_video:
+        if shared_memory is None:
+            print("Error: --pipeline requires Python 3.8 or newer")
+            sys.exit(1)
+
+        mode_init = init_pipeline
+        mode_process = process_pipeline
+        mode_cleanup = None
+
+    # Recording for a given display resolution works without any device
+    if mode_process == process_record and args.geometry is not None:
+        dev = None
+        props = {'res_x': args.geometry[0], 'res_y': args.geometry[1], 'color_bits': 1, 'display': b''}
+
+    else:
+        # Try to connect to the USB device.
+        # Quit if that fails, nothing we can do without it anyway.
+        dev = open_usb_device()
+        if dev is None:
+            print("Failed to open USB device")
+            sys.exit(1)
+
+        # Retrieve the display properties from the USB device
+        props = get_usb_device_properties(dev)
+
+        # Set the contrast first, so it's already set for whatever comes next
+        if args.contrast is not None:
+            batch = Batch()
+            batch.command(*contrast_commands(props['display'], args.contrast))
+            print('-> [BATCH] contrast {}'.format(args.contrast))
+            batch.send(dev)
+
+    # Set up the script-internal meta data dictionary.
+    # This dictionary holds everything needed to handle the image processing
+    # and USB sending: parsed command line parameters, USB device object,
+    # display properties ..and anything that the init callback returns.
+    # The init callback gets the display properties as well, so it can set up
+    # its input source already for the display's resolution.
+    #
+    # If there is no init callback, mode_data gets simply initialized with
+    # an empty dictionary (and filled with more data later on)
+    if mode_init is not None:
+        mode_data = mode_init(args, props)
+    else:
+        mode_data = {}
+
+    # Store the display properties in the meta data dictionary
+    mode_data.update(props)
 
     # Add all other useful data to the dictionary
     mode_data['dev'] = dev
     mode_data['args'] = args
 
+    # Looping playbacks can cache their converted frames for later passes
+    if args.loop and args.cache > 0:
+        mode_data['cache'] = FrameCache(args.cache * 1048576)
+
     # Run the frame-processing callback, which may run inside any form of loop.
     # The loop can be interrupted with CTRL+C, which is caught here to provide
     # a graceful way to end it all.
@@ -461,6 +3058,8 @@ def main():
     except KeyboardInterrupt:
         print("")
 
+    print_transfer_stats(mode_data)
+
     # If we reached here, the frame-processing callback was either terminated
     # by natural causes (i.e. everything that was supposed to be send was sent),
     # or it was aborted with CTRL+C. Either way, we're done sending images to
@@ -469,7 +3068,8 @@ def main():
     if mode_cleanup is not None:
         mode_cleanup(mode_data)
 
-    close_usb_device(dev)
+    if dev is not None:
+        close_usb_device(dev)
     
     # The End.
 
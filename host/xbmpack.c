@@ -0,0 +1,322 @@
+/*
+ * usbxbm - XBM to LCD by USB
+ * Host-side Frame Packing Extension
+ *
+ * Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Optional native implementation of usbxbm.py's pack_gray() function.
+ *
+ * Takes a display-sized 8-bit grayscale frame and turns it in one single pass
+ * into the displays' page-major memory layout: pages of 8 vertically stacked
+ * pixels, top-most pixel in the LSB, sent page by page, column by column.
+ *
+ * Each page (i.e. 8 rows) is handled in blocks of 16 (SSE2) or 32 (AVX2)
+ * columns: every row is compared against the threshold, the comparison
+ * result's MSBs are collected with movemask, giving one bit per column for
+ * each of the 8 rows, and each 8x8 bit block is then transposed so every
+ * column ends up as one byte with one bit per row. Whatever columns are
+ * left at the end are handled by the scalar implementation, which is also
+ * used on its own on anything that isn't x86.
+ *
+ * Build it with
+ *     python3 setup.py build_ext --inplace
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/** Signature shared by all kernels */
+typedef void (*kernel_t)(const uint8_t *, uint8_t *, Py_ssize_t, Py_ssize_t, uint8_t);
+
+
+/**
+ * Pack a single column of a page into one byte.
+ *
+ * @param src Pointer to the column's top-most pixel within the page
+ * @param width Frame width, i.e. distance between two rows
+ * @param threshold Pixels up to this value are set
+ * @return Packed column byte
+ */
+static inline uint8_t
+pack_column(const uint8_t *src, Py_ssize_t width, uint8_t threshold)
+{
+    uint8_t out = 0;
+    int row;
+
+    for (row = 0; row < 8; row++) {
+        if (src[row * width] <= threshold) {
+            out |= (1 << row);
+        }
+    }
+
+    return out;
+}
+
+/**
+ * Scalar kernel, packs columns [start, width) of every page.
+ *
+ * @param src Grayscale frame, width * height bytes
+ * @param dst Output buffer, width * height / 8 bytes
+ * @param width Frame width in pixels
+ * @param height Frame height in pixels, multiple of 8
+ * @param threshold Pixels up to this value are set
+ * @param start First column to pack
+ */
+static void
+pack_scalar_from(const uint8_t *src, uint8_t *dst, Py_ssize_t width, Py_ssize_t height,
+        uint8_t threshold, Py_ssize_t start)
+{
+    Py_ssize_t page;
+    Py_ssize_t col;
+
+    for (page = 0; page < height / 8; page++) {
+        for (col = start; col < width; col++) {
+            dst[page * width + col] = pack_column(&src[page * 8 * width + col], width, threshold);
+        }
+    }
+}
+
+/** Scalar kernel, packs the whole frame */
+static void
+pack_scalar(const uint8_t *src, uint8_t *dst, Py_ssize_t width, Py_ssize_t height, uint8_t threshold)
+{
+    pack_scalar_from(src, dst, width, height, threshold, 0);
+}
+
+#ifdef HAVE_X86_KERNELS
+/**
+ * Transpose an 8x8 bit matrix.
+ *
+ * Input byte r holds row r with column c in bit c, output byte c holds
+ * column c with row r in bit r.
+ *
+ * @param x Bit matrix to transpose
+ * @return Transposed bit matrix
+ */
+static inline uint64_t
+transpose8x8(uint64_t x)
+{
+    uint64_t t;
+
+    t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+    x = x ^ t ^ (t << 28);
+
+    return x;
+}
+
+/**
+ * Transpose the movemask results of 8 rows and store the packed columns.
+ *
+ * @param masks Per-row movemask results, bit c set if column c is set
+ * @param dst Output position of the block's first column
+ * @param blocks Number of 8-column blocks within the masks
+ */
+static inline void
+store_block(const uint32_t masks[8], uint8_t *dst, int blocks)
+{
+    uint64_t x;
+    int block;
+    int row;
+
+    for (block = 0; block < blocks; block++) {
+        x = 0;
+        for (row = 0; row < 8; row++) {
+            x |= (uint64_t) ((masks[row] >> (block * 8)) & 0xff) << (row * 8);
+        }
+        x = transpose8x8(x);
+        memcpy(&dst[block * 8], &x, 8);
+    }
+}
+
+/** SSE2 kernel, 16 columns at a time */
+__attribute__((target("sse2")))
+static void
+pack_sse2(const uint8_t *src, uint8_t *dst, Py_ssize_t width, Py_ssize_t height, uint8_t threshold)
+{
+    const __m128i thresh = _mm_set1_epi8((char) threshold);
+    uint32_t masks[8];
+    Py_ssize_t page;
+    Py_ssize_t col;
+    __m128i v;
+    int row;
+
+    for (page = 0; page < height / 8; page++) {
+        for (col = 0; col + 16 <= width; col += 16) {
+            for (row = 0; row < 8; row++) {
+                v = _mm_loadu_si128((const __m128i *) &src[(page * 8 + row) * width + col]);
+                /* unsigned v <= threshold  <=>  min(v, threshold) == v */
+                v = _mm_cmpeq_epi8(_mm_min_epu8(v, thresh), v);
+                masks[row] = (uint32_t) _mm_movemask_epi8(v);
+            }
+            store_block(masks, &dst[page * width + col], 2);
+        }
+    }
+
+    pack_scalar_from(src, dst, width, height, threshold, width - (width % 16));
+}
+
+/** AVX2 kernel, 32 columns at a time */
+__attribute__((target("avx2")))
+static void
+pack_avx2(const uint8_t *src, uint8_t *dst, Py_ssize_t width, Py_ssize_t height, uint8_t threshold)
+{
+    const __m256i thresh = _mm256_set1_epi8((char) threshold);
+    uint32_t masks[8];
+    Py_ssize_t page;
+    Py_ssize_t col;
+    __m256i v;
+    int row;
+
+    for (page = 0; page < height / 8; page++) {
+        for (col = 0; col + 32 <= width; col += 32) {
+            for (row = 0; row < 8; row++) {
+                v = _mm256_loadu_si256((const __m256i *) &src[(page * 8 + row) * width + col]);
+                v = _mm256_cmpeq_epi8(_mm256_min_epu8(v, thresh), v);
+                masks[row] = (uint32_t) _mm256_movemask_epi8(v);
+            }
+            store_block(masks, &dst[page * width + col], 4);
+        }
+    }
+
+    /* 84 pixel wide Nokia leaves 20 columns, so let SSE2 take care of 16 of them */
+    if (width % 32 >= 16) {
+        col = width - (width % 32);
+        for (page = 0; page < height / 8; page++) {
+            for (row = 0; row < 8; row++) {
+                __m128i w = _mm_loadu_si128((const __m128i *) &src[(page * 8 + row) * width + col]);
+                w = _mm_cmpeq_epi8(_mm_min_epu8(w, _mm256_castsi256_si128(thresh)), w);
+                masks[row] = (uint32_t) _mm_movemask_epi8(w);
+            }
+            store_block(masks, &dst[page * width + col], 2);
+        }
+    }
+
+    pack_scalar_from(src, dst, width, height, threshold, width - (width % 16));
+}
+#endif /* HAVE_X86_KERNELS */
+
+
+/** Kernel picked at module initialization */
+static kernel_t kernel = pack_scalar;
+/** Name of the picked kernel */
+static const char *kernel_name = "scalar";
+
+
+/**
+ * xbmpack.pack(gray, width, height, threshold)
+ *
+ * Python wrapper around the picked kernel.
+ */
+static PyObject *
+xbmpack_pack(PyObject *self, PyObject *args)
+{
+    Py_buffer src;
+    Py_ssize_t width;
+    Py_ssize_t height;
+    int threshold;
+    PyObject *result;
+
+    (void) self;
+
+    if (!PyArg_ParseTuple(args, "y*nni", &src, &width, &height, &threshold)) {
+        return NULL;
+    }
+
+    if (width <= 0 || height <= 0 || height % 8 != 0) {
+        PyBuffer_Release(&src);
+        PyErr_SetString(PyExc_ValueError, "height must be a positive multiple of 8");
+        return NULL;
+    }
+
+    if (src.len != width * height) {
+        PyBuffer_Release(&src);
+        PyErr_Format(PyExc_ValueError, "expected %zd bytes of grayscale data, got %zd",
+                width * height, src.len);
+        return NULL;
+    }
+
+    if (threshold < 0 || threshold > 255) {
+        PyBuffer_Release(&src);
+        PyErr_SetString(PyExc_ValueError, "threshold must be within 0-255");
+        return NULL;
+    }
+
+    result = PyBytes_FromStringAndSize(NULL, width * height / 8);
+    if (result != NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        kernel(src.buf, (uint8_t *) PyBytes_AS_STRING(result), width, height, (uint8_t) threshold);
+        Py_END_ALLOW_THREADS
+    }
+
+    PyBuffer_Release(&src);
+    return result;
+}
+
+static PyMethodDef xbmpack_methods[] = {
+    {"pack", xbmpack_pack, METH_VARARGS,
+        "pack(gray, width, height, threshold) -> bytes\n\n"
+        "Threshold a contiguous 8-bit grayscale frame and pack it into page-major display data."},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef xbmpack_module = {
+    PyModuleDef_HEAD_INIT,
+    "xbmpack",
+    "usbxbm native frame packing",
+    -1,
+    xbmpack_methods,
+    NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC
+PyInit_xbmpack(void)
+{
+    PyObject *module;
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = pack_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = pack_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+
+    module = PyModule_Create(&xbmpack_module);
+    if (module != NULL) {
+        PyModule_AddStringConstant(module, "kernel", kernel_name);
+    }
+
+    return module;
+}
@@ -0,0 +1,185 @@
+#
+# usbxbm - XBM to LCD by USB
+# Packed Frame Container Format
+#
+# Copyright (C) 2020 Sven Gregori <sven@craplab.fi>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+#
+# An .xbmv file stores frames that are already converted into raw display
+# data, so playing it back only needs to hand each frame to the device as-is.
+# All values are little-endian.
+#
+# Header, 32 bytes:
+#   4s  magic "XBMV"
+#   H   format version
+#   H   header size in bytes
+#   H   display width in pixels
+#   H   display height in pixels
+#   I   number of frames
+#   Q   file offset of the frame index
+#   8x  reserved
+#
+# Frame data follows right after the header, one frame after the other.
+#
+# Frame index, one 24 byte entry per frame:
+#   Q   frame timestamp in microseconds since the first frame
+#   Q   file offset of the frame data
+#   I   frame data size in bytes
+#   4x  reserved
+#
+import mmap
+import struct
+
+MAGIC = b'XBMV'
+VERSION = 1
+
+HEADER = struct.Struct('<4s H H H H I Q 8x')
+INDEX_ENTRY = struct.Struct('<Q Q I 4x')
+
+
+class XbmvWriter:
+    """
+    Write packed display frames into a new .xbmv file.
+    """
+
+    def __init__(self, path, res_x, res_y):
+        """
+        Create the file and reserve space for the header.
+
+        Parameters:
+        path (str): Path of the file to create
+        res_x (int): Display width in pixels
+        res_y (int): Display height in pixels
+        """
+        self.file = open(path, 'wb')
+        self.res_x = res_x
+        self.res_y = res_y
+        self.index = []
+        self.file.write(bytes(HEADER.size))
+
+    def write(self, frame_data, timestamp):
+        """
+        Append a single frame.
+
+        Parameters:
+        frame_data (bytes): Raw frame data in the display's memory layout
+        timestamp (float): Frame timestamp in seconds since the first frame
+        """
+        self.index.append((int(timestamp * 1000000), self.file.tell(), len(frame_data)))
+        self.file.write(frame_data)
+
+    def close(self):
+        """
+        Write the frame index and the final header, and close the file.
+        """
+        index_offset = self.file.tell()
+        for entry in self.index:
+            self.file.write(INDEX_ENTRY.pack(*entry))
+
+        self.file.seek(0)
+        self.file.write(HEADER.pack(MAGIC, VERSION, HEADER.size, self.res_x, self.res_y,
+                                    len(self.index), index_offset))
+        self.file.close()
+
+
+class XbmvReader:
+    """
+    Memory-mapped read access to an .xbmv file.
+    """
+
+    def __init__(self, path):
+        """
+        Map the file and read its header and frame index.
+
+        Parameters:
+        path (str): Path of the file to open
+
+        Raises:
+        ValueError: if the file isn't a supported .xbmv file
+        """
+        with open(path, 'rb') as f:
+            self.mmap = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        if len(self.mmap) < HEADER.size:
+            raise ValueError('{}: file too short'.format(path))
+
+        (magic, version, header_size, self.res_x, self.res_y,
+         self.frame_count, index_offset) = HEADER.unpack_from(self.mmap)
+
+        if magic != MAGIC or version != VERSION:
+            raise ValueError('{}: not an .xbmv version {} file'.format(path, VERSION))
+
+        if index_offset + self.frame_count * INDEX_ENTRY.size > len(self.mmap):
+            raise ValueError('{}: truncated frame index'.format(path))
+
+        self.index = list(INDEX_ENTRY.iter_unpack(
+            self.mmap[index_offset:index_offset + self.frame_count * INDEX_ENTRY.size]))
+        self.data = memoryview(self.mmap)
+
+    def frame(self, number):
+        """
+        Get a given frame without copying it.
+
+        Parameters:
+        number (int): Frame number, starting from 0
+
+        Returns:
+        tuple: (timestamp in seconds, memoryview of the raw frame data)
+        """
+        timestamp, offset, size = self.index[number]
+        return timestamp / 1000000, self.data[offset:offset + size]
+
+    def seek(self, timestamp):
+        """
+        Find the frame shown at a given time.
+
+        Parameters:
+        timestamp (float): Time in seconds since the first frame
+
+        Returns:
+        int: number of the last frame with a timestamp not after the given one
+        """
+        target = int(timestamp * 1000000)
+        low, high = 0, self.frame_count
+        while low < high:
+            middle = (low + high) // 2
+            if self.index[middle][0] <= target:
+                low = middle + 1
+            else:
+                high = middle
+
+        return max(low - 1, 0)
+
+    def close(self):
+        """
+        Unmap the file.
+
+        Frames handed out by frame() may still be referenced, e.g. from the
+        traceback of an interrupted playback, in which case the mapping can't
+        be closed yet. It's then left for the garbage collector to unmap once
+        the last reference is gone, instead of raising a BufferError that
+        would replace whatever exception is currently being handled.
+        """
+        try:
+            self.data.release()
+            self.mmap.close()
+        except BufferError:
+            pass